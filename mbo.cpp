@@ -3,14 +3,27 @@
 #include <cstdint>
 #include <cstring>
 #include <cassert>
+#include <cerrno>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/mempolicy.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
 #include <vector>
 #include <memory>
 #include <algorithm>
 #include <span>
+#include <atomic>
+#include <thread>
+#include <optional>
+#include <coroutine>
+#include <utility>
+#include <immintrin.h>
 #include <boost/container/flat_map.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/unordered/unordered_flat_map.hpp>
@@ -196,7 +209,10 @@ enum DeltaType : uint8_t {
     TickInfo = 0,        // Event metadata (always present, always first)
     Update = 1,          // Modify existing level (implicit delete if qty/count → 0)
     Insert = 2,          // Add level at index (with optional shift)
-    CrossingComplete = 3 // Signal that crossing has fully resolved (1 byte)
+    CrossingComplete = 3, // Signal that crossing has fully resolved (1 byte)
+    Snapshot = 4,        // Full top-20 book for bootstrap (header + packed rows, spans chunks)
+    Sweep = 5,           // Remove top K levels on one side, then append refills (crossing)
+    Group = 6            // Packed chunks only: header for one token's complete event
 };
 
 struct TickInfoDelta {
@@ -272,49 +288,194 @@ struct CrossingCompleteDelta {
 } __attribute__((packed));
 static_assert(sizeof(CrossingCompleteDelta) == 1);
 
-struct DeltaChunk {
+// Multi-level sweep from the touch: replaces K × (Update(→0) at index 0 + refill Insert)
+// from a crossing with one memmove on the receiver. Followed by num_refills OutputLevel
+// rows that land at the freed tail [20-K, 20-K+num_refills); the rest of the tail is zeroed.
+struct SweepDelta {
+    uint8_t type;              // = 5
+    uint8_t side_levels;       // bits 0-4: levels removed from the top (1-20), bit 5: side
+    uint8_t num_refills;       // Rows following the header (≤ levels removed)
+    uint8_t reserved;
+    
+    size_t size() const { return sizeof(SweepDelta) + num_refills * sizeof(OutputLevel); }
+    
+    friend std::ostream& operator<<(std::ostream& os, const SweepDelta& d) {
+        bool side = (d.side_levels >> 5) & 1;
+        return os << "Sweep{side=" << (side ? "ask" : "bid")
+                  << ", levels=" << (int)(d.side_levels & 0x1F)
+                  << ", refills=" << (int)d.num_refills << "}";
+    }
+} __attribute__((packed));
+static_assert(sizeof(SweepDelta) == 4);
+
+// Per-event top-of-book summary for BBO-only consumers, stamped into every chunk header
+// of the event (and the GroupHeader when packed) so they can skip decoding events that
+// leave level 0 alone. Per side: bits 0-4 topmost level touched (20 = none), bit 7 best
+// price changed. Snapshots mark both sides as touched and moved.
+struct EventSummary {
+    uint8_t side_top[2] = {20, 20};  // [bid, ask]
+    
+    uint8_t min_index(bool is_ask) const { return side_top[is_ask] & 0x1F; }
+    bool best_price_changed(bool is_ask) const { return side_top[is_ask] & 0x80; }
+    bool touches_top() const { return min_index(false) == 0 || min_index(true) == 0; }
+    
+    void touch(bool is_ask, int index) {
+        if (index < min_index(is_ask)) side_top[is_ask] = static_cast<uint8_t>((side_top[is_ask] & 0x80) | index);
+    }
+    void mark_best_price_changed(bool is_ask) { side_top[is_ask] |= 0x80; }
+    
+    friend std::ostream& operator<<(std::ostream& os, const EventSummary& s) {
+        return os << "top=" << (int)s.min_index(false) << (s.best_price_changed(false) ? "*" : "")
+                  << "/" << (int)s.min_index(true) << (s.best_price_changed(true) ? "*" : "");
+    }
+} __attribute__((packed));
+static_assert(sizeof(EventSummary) == 2);
+
+// Cross-token packing: a ChunkPacked chunk carries several complete single-chunk events,
+// each prefixed by a GroupHeader (chunk.token = 0, chunk.num_deltas = number of groups).
+struct GroupHeader {
+    uint8_t type;              // = 6
+    uint8_t num_deltas;        // Deltas in this group
+    uint16_t bytes;            // Delta bytes following the header
+    uint32_t token;
+    EventSummary summary;      // The event's chunk-header summary
+    
+    friend std::ostream& operator<<(std::ostream& os, const GroupHeader& g) {
+        return os << "Group{tok=" << g.token << ", deltas=" << (int)g.num_deltas << ", " << g.summary << "}";
+    }
+} __attribute__((packed));
+static_assert(sizeof(GroupHeader) == 10);
+
+// Bulk book state for late joiners, replacing TickInfo + 40×Insert (18 chunks).
+// Header is followed by bid rows then ask rows as a raw byte stream that continues
+// across chunk payloads (continuation chunks carry ChunkContinuation and num_deltas=0).
+// Absolute rows use OutputLevel layout so the receiver memcpy's them straight into
+// OutputRecord::bids/asks. Tick rows send each side's first level as an OutputLevel,
+// then SnapshotTickRows with the price as a tick offset from that first level.
+struct SnapshotDelta {
+    uint8_t type;              // = 4
+    uint8_t flags;             // bit 0: tick-offset rows
+    uint8_t bid_levels;        // 0-20
+    uint8_t ask_levels;        // 0-20
+    uint32_t record_idx;       // Last record reflected in the snapshot
+    int32_t tick_size;         // Only meaningful for tick-offset rows
+
+    bool tick_rows() const { return flags & 0x01; }
+
+    // Total row bytes following the header for one side
+    size_t side_bytes(uint8_t levels) const;
+
+    friend std::ostream& operator<<(std::ostream& os, const SnapshotDelta& d) {
+        return os << "Snapshot{rec=" << d.record_idx
+                  << ", bids=" << (int)d.bid_levels
+                  << ", asks=" << (int)d.ask_levels
+                  << ", tick=" << (d.tick_rows() ? d.tick_size : 0) << "}";
+    }
+} __attribute__((packed));
+static_assert(sizeof(SnapshotDelta) == 12);
+
+struct SnapshotTickRow {
+    uint16_t ticks;            // Distance from the side's first level, away from the touch
+    int32_t qty;
+    int32_t num_orders;
+} __attribute__((packed));
+static_assert(sizeof(SnapshotTickRow) == 10);
+
+inline size_t SnapshotDelta::side_bytes(uint8_t levels) const {
+    if (levels == 0) return 0;
+    return tick_rows() ? sizeof(OutputLevel) + (levels - 1) * sizeof(SnapshotTickRow)
+                       : levels * sizeof(OutputLevel);
+}
+
+enum ChunkFlags : uint8_t {
+    ChunkFinal = 0x01,         // Last chunk of the event (book ready for strategy)
+    ChunkContinuation = 0x02,  // Payload continues a snapshot row stream (no deltas)
+    ChunkPacked = 0x04         // Payload is GroupHeader-prefixed events from several tokens
+};
+
+// Transport geometry is a compile-time choice (DELTAS.md weighs 64B vs 128B):
+//   make CHUNK_BYTES=128
+#ifndef MBO_CHUNK_BYTES
+#define MBO_CHUNK_BYTES 64
+#endif
+
+template<size_t Bytes>
+struct BasicDeltaChunk {
+    static constexpr size_t HEADER = 8;   // token:4 + flags:1 + num_deltas:1 + summary:2
+    static constexpr size_t PAYLOAD = Bytes - HEADER;
+    
     uint32_t token = 0;
-    uint8_t flags = 0;             // bit 0: final (book ready for strategy)
+    uint8_t flags = 0;             // ChunkFlags: bit 0 final, bit 1 continuation
     uint8_t num_deltas = 0;        // Number of deltas in this chunk (1-N)
-    uint8_t payload[58] = {};      // Variable-length delta sequence (record_idx now in TickInfoDelta)
+    EventSummary summary;          // Whole event, repeated in each of its chunks
+    uint8_t payload[PAYLOAD] = {}; // Variable-length delta sequence (record_idx now in TickInfoDelta)
     
-    friend std::ostream& operator<<(std::ostream& os, const DeltaChunk& chunk) {
+    friend std::ostream& operator<<(std::ostream& os, const BasicDeltaChunk& chunk) {
         os << "Chunk[tok=" << chunk.token 
-           << ", final=" << (chunk.flags & 1) << "]: ";
+           << ", final=" << (chunk.flags & ChunkFinal) << ", " << chunk.summary << "]: ";
         
         // Iterate through deltas in payload
         size_t offset = 0;
-        size_t total_bytes = 6;  // Header: token:4 + flags:1 + num_deltas:1
+        size_t total_bytes = HEADER;
+        
+        if (chunk.flags & ChunkContinuation) {
+            return os << "SnapshotRows{...} = " << Bytes << "B";
+        }
         
-        for (uint8_t i = 0; i < chunk.num_deltas && offset < 58; ++i) {
+        if (chunk.flags & ChunkPacked) {
+            for (uint8_t g = 0; g < chunk.num_deltas && offset + sizeof(GroupHeader) <= PAYLOAD; ++g) {
+                const GroupHeader* group = reinterpret_cast<const GroupHeader*>(&chunk.payload[offset]);
+                if (g > 0) os << " | ";
+                os << *group;
+                offset += sizeof(GroupHeader) + group->bytes;
+            }
+            return os << " = " << (HEADER + offset) << "B";
+        }
+        
+        for (uint8_t i = 0; i < chunk.num_deltas && offset < PAYLOAD; ++i) {
             if (i > 0) os << " + ";
             
             uint8_t dtype = chunk.payload[offset];
             
             if (dtype == DeltaType::TickInfo) {
-                if (offset + sizeof(TickInfoDelta) > 58) break;
+                if (offset + sizeof(TickInfoDelta) > PAYLOAD) break;
                 const TickInfoDelta* delta = reinterpret_cast<const TickInfoDelta*>(&chunk.payload[offset]);
                 os << *delta;
                 total_bytes += sizeof(TickInfoDelta);
                 offset += sizeof(TickInfoDelta);
             } else if (dtype == DeltaType::Update) {
-                if (offset + sizeof(UpdateDelta) > 58) break;
+                if (offset + sizeof(UpdateDelta) > PAYLOAD) break;
                 const UpdateDelta* delta = reinterpret_cast<const UpdateDelta*>(&chunk.payload[offset]);
                 os << *delta;
                 total_bytes += sizeof(UpdateDelta);
                 offset += sizeof(UpdateDelta);
             } else if (dtype == DeltaType::Insert) {
-                if (offset + sizeof(InsertDelta) > 58) break;
+                if (offset + sizeof(InsertDelta) > PAYLOAD) break;
                 const InsertDelta* delta = reinterpret_cast<const InsertDelta*>(&chunk.payload[offset]);
                 os << *delta;
                 total_bytes += sizeof(InsertDelta);
                 offset += sizeof(InsertDelta);
             } else if (dtype == DeltaType::CrossingComplete) {
-                if (offset + sizeof(CrossingCompleteDelta) > 58) break;
+                if (offset + sizeof(CrossingCompleteDelta) > PAYLOAD) break;
                 const CrossingCompleteDelta* delta = reinterpret_cast<const CrossingCompleteDelta*>(&chunk.payload[offset]);
                 os << *delta;
                 total_bytes += sizeof(CrossingCompleteDelta);
                 offset += sizeof(CrossingCompleteDelta);
+            } else if (dtype == DeltaType::Sweep) {
+                if (offset + sizeof(SweepDelta) > PAYLOAD) break;
+                const SweepDelta* delta = reinterpret_cast<const SweepDelta*>(&chunk.payload[offset]);
+                if (offset + delta->size() > PAYLOAD) break;
+                os << *delta;
+                total_bytes += delta->size();
+                offset += delta->size();
+            } else if (dtype == DeltaType::Snapshot) {
+                if (offset + sizeof(SnapshotDelta) > PAYLOAD) break;
+                const SnapshotDelta* delta = reinterpret_cast<const SnapshotDelta*>(&chunk.payload[offset]);
+                os << *delta;
+                // Rows fill the rest of this payload (and any continuation chunks)
+                size_t rows = delta->side_bytes(delta->bid_levels) + delta->side_bytes(delta->ask_levels);
+                total_bytes += sizeof(SnapshotDelta) + std::min(rows, PAYLOAD - offset - sizeof(SnapshotDelta));
+                break;
             } else {
                 os << "Unknown{type=" << (int)dtype << "}";
                 break;
@@ -325,7 +486,9 @@ struct DeltaChunk {
         return os;
     }
 } __attribute__((packed));
-static_assert(sizeof(DeltaChunk) == 64);
+using DeltaChunk = BasicDeltaChunk<MBO_CHUNK_BYTES>;
+static_assert(sizeof(DeltaChunk) == MBO_CHUNK_BYTES);
+static_assert(DeltaChunk::PAYLOAD >= sizeof(TickInfoDelta), "largest fixed-size delta must fit a chunk");
 
 // --- Bitmask Helper Functions ---
 inline uint8_t pack_side_index(bool is_ask, uint8_t index) {
@@ -352,34 +515,61 @@ inline bool unpack_shift(uint8_t packed) {
  * Clean encapsulation over scattered pre-checks but relies on inlining (verified -O3)
  *  to avoid wasted argument computation.
  */
-class DeltaEmitter {
+template<typename ChunkT>
+class BasicDeltaEmitter {
 private:
-    static constexpr size_t MAX_CHUNKS = 20;  // Worst case: snapshot with 40 levels = ~18 chunks + buffer
-    boost::container::static_vector<DeltaChunk, MAX_CHUNKS> chunks_;
+    static constexpr size_t PAYLOAD = ChunkT::PAYLOAD;
+    static constexpr size_t MAX_CHUNKS = 20;  // Worst case: deep multi-level cross at 64B + buffer
+    boost::container::static_vector<ChunkT, MAX_CHUNKS> chunks_;
     size_t current_offset_;  // Offset into chunks_.back().payload
     Token token_;
     uint32_t record_idx_;
+    EventSummary summary_;   // Stamped into every chunk header by finalize()
     
-    template<typename DeltaT>
-    void append_delta(const DeltaT& delta) {
+    // Claim space for one whole delta (never split across chunks)
+    uint8_t* reserve_delta(size_t bytes) {
         // Ensure we have a chunk to work with
-        if (chunks_.empty() || current_offset_ + sizeof(DeltaT) > 58) [[unlikely]] {
+        if (chunks_.empty() || current_offset_ + bytes > PAYLOAD) [[unlikely]] {
             // Start new chunk (default initialized to zeros)
             chunks_.emplace_back();
-            DeltaChunk& chunk = chunks_.back();
+            ChunkT& chunk = chunks_.back();
             chunk.token = token_;
             current_offset_ = 0;
         }
         
         // Build delta directly in vector's last chunk
-        DeltaChunk& chunk = chunks_.back();
-        memcpy(&chunk.payload[current_offset_], &delta, sizeof(DeltaT));
-        current_offset_ += sizeof(DeltaT);
+        ChunkT& chunk = chunks_.back();
+        uint8_t* dst = &chunk.payload[current_offset_];
+        current_offset_ += bytes;
         chunk.num_deltas++;
+        return dst;
+    }
+    
+    template<typename DeltaT>
+    void append_delta(const DeltaT& delta) {
+        memcpy(reserve_delta(sizeof(DeltaT)), &delta, sizeof(DeltaT));
+    }
+    
+    // Raw byte stream continuing after the last delta; spills into continuation chunks
+    void append_bytes(const void* src, size_t n) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(src);
+        while (n > 0) {
+            if (current_offset_ == PAYLOAD) {
+                chunks_.emplace_back();
+                chunks_.back().token = token_;
+                chunks_.back().flags = ChunkContinuation;
+                current_offset_ = 0;
+            }
+            size_t take = std::min(n, PAYLOAD - current_offset_);
+            memcpy(&chunks_.back().payload[current_offset_], bytes, take);
+            current_offset_ += take;
+            bytes += take;
+            n -= take;
+        }
     }
     
 public:
-    DeltaEmitter() : current_offset_(0), token_(0), record_idx_(0) {}
+    BasicDeltaEmitter() : current_offset_(0), token_(0), record_idx_(0) {}
     
     void set_event(Token token, uint32_t record_idx) {
         token_ = token;
@@ -409,6 +599,7 @@ public:
         // Only emit if index is in top 20 levels
         if (index >= 20) [[unlikely]] return;
         
+        summary_.touch(is_ask, index);
         UpdateDelta delta;
         delta.type = DeltaType::Update;
         delta.side_index = pack_side_index(is_ask, index);
@@ -425,6 +616,7 @@ public:
         // Only emit if index is in top 20 levels
         if (index >= 20) [[unlikely]] return;
         
+        summary_.touch(is_ask, index);
         InsertDelta delta;
         delta.type = DeltaType::Insert;
         delta.side_index_shift = pack_side_index_shift(is_ask, index, shift);
@@ -435,6 +627,44 @@ public:
         append_delta(delta);
     }
     
+    // Remove the top `levels` on one side and append refills (new tail levels, best first).
+    // Split into several SweepDeltas when the rows don't fit the current chunk; applying
+    // the pieces in order is equivalent because refills are assigned greedily.
+    void emit_sweep(bool is_ask, int levels, std::span<const OutputLevel> refills) {
+        always_assert(!chunks_.empty() && 
+               "emit_tick_info() must be called before emit_sweep()");
+        
+        if (levels <= 0) [[unlikely]] return;
+        if (levels > 20) levels = 20;  // Only the visible book is swept
+        always_assert(refills.size() <= static_cast<size_t>(levels));
+        summary_.touch(is_ask, 0);
+        
+        size_t levels_left = levels;
+        size_t next = 0;
+        while (true) {
+            size_t rows_left = refills.size() - next;
+            size_t free = PAYLOAD - current_offset_;
+            size_t fit = free >= sizeof(SweepDelta) ? (free - sizeof(SweepDelta)) / sizeof(OutputLevel) : 0;
+            if (fit == 0 && rows_left > 0) fit = (PAYLOAD - sizeof(SweepDelta)) / sizeof(OutputLevel);  // Next chunk
+            size_t rows = std::min(rows_left, fit);
+            bool last = (rows == rows_left);
+            size_t removed = last ? levels_left : rows;
+            
+            SweepDelta delta;
+            delta.type = DeltaType::Sweep;
+            delta.side_levels = pack_side_index(is_ask, static_cast<uint8_t>(removed));
+            delta.num_refills = static_cast<uint8_t>(rows);
+            delta.reserved = 0;
+            uint8_t* dst = reserve_delta(sizeof(SweepDelta) + rows * sizeof(OutputLevel));
+            memcpy(dst, &delta, sizeof(SweepDelta));
+            memcpy(dst + sizeof(SweepDelta), &refills[next], rows * sizeof(OutputLevel));
+            
+            levels_left -= removed;
+            next += rows;
+            if (last) break;
+        }
+    }
+    
     void emit_crossing_complete() {
         // Signal that crossing has fully resolved - receiver synthesizes N/M/X
         always_assert(!chunks_.empty() && 
@@ -445,23 +675,84 @@ public:
         append_delta(delta);
     }
     
+    // Standalone bootstrap sequence (no TickInfo): levels are best-first, actual prices.
+    // tick_size > 0 requests tick-offset rows; falls back to absolute rows if any level
+    // is off-grid or too far from the touch to encode.
+    void emit_snapshot(Price tick_size, std::span<const OutputLevel> bids, std::span<const OutputLevel> asks) {
+        always_assert(chunks_.empty() && "emit_snapshot() must start a fresh sequence");
+        always_assert(bids.size() <= 20 && asks.size() <= 20);
+        
+        auto fits_ticks = [tick_size](std::span<const OutputLevel> side) {
+            for (const auto& lvl : side) {
+                Price dist = lvl.price - side[0].price;
+                if (dist < 0) dist = -dist;
+                if (dist % tick_size != 0 || dist / tick_size > UINT16_MAX) return false;
+            }
+            return true;
+        };
+        bool tick_rows = tick_size > 0 && tick_size <= INT32_MAX && fits_ticks(bids) && fits_ticks(asks);
+        for (bool is_ask : {false, true}) {
+            summary_.touch(is_ask, 0);
+            summary_.mark_best_price_changed(is_ask);
+        }
+        
+        SnapshotDelta delta;
+        delta.type = DeltaType::Snapshot;
+        delta.flags = tick_rows ? 0x01 : 0x00;
+        delta.bid_levels = static_cast<uint8_t>(bids.size());
+        delta.ask_levels = static_cast<uint8_t>(asks.size());
+        delta.record_idx = record_idx_;
+        delta.tick_size = tick_rows ? static_cast<int32_t>(tick_size) : 0;
+        append_delta(delta);
+        
+        for (auto side : {bids, asks}) {
+            if (!tick_rows) {
+                append_bytes(side.data(), side.size() * sizeof(OutputLevel));
+                continue;
+            }
+            if (side.empty()) continue;
+            append_bytes(&side[0], sizeof(OutputLevel));
+            for (size_t i = 1; i < side.size(); ++i) {
+                Price dist = side[i].price - side[0].price;
+                SnapshotTickRow row;
+                row.ticks = static_cast<uint16_t>((dist < 0 ? -dist : dist) / tick_size);
+                row.qty = side[i].qty;
+                row.num_orders = side[i].num_orders;
+                append_bytes(&row, sizeof(row));
+            }
+        }
+    }
+    
+    // Publisher knows whether a side's best price moved; the deltas alone don't say
+    // (an Update at index 0 may or may not delete the level)
+    void mark_best_price_changed(bool is_ask) {
+        summary_.mark_best_price_changed(is_ask);
+    }
+    
     void finalize() {
-        // Mark last chunk as final
+        // Mark last chunk as final, stamp the event summary into every header
         if (!chunks_.empty()) {
-            chunks_.back().flags = 1;
+            chunks_.back().flags |= ChunkFinal;
         }
+        for (auto& chunk : chunks_) chunk.summary = summary_;
     }
     
-    std::span<const DeltaChunk> get_chunks() const {
-        return std::span<const DeltaChunk>(chunks_.data(), chunks_.size());
+    // Payload bytes used in the last chunk (whole event for single-chunk events)
+    size_t tail_bytes() const { return current_offset_; }
+    
+    std::span<const ChunkT> get_chunks() const {
+        return std::span<const ChunkT>(chunks_.data(), chunks_.size());
     }
     
     void clear() {
         chunks_.clear();
         current_offset_ = 0;
+        summary_ = EventSummary{};
     }
 };
 
+using DeltaEmitter = BasicDeltaEmitter<DeltaChunk>;
+
 struct OrderInfo {
     bool is_ask;    // Don't rely on exchange telling us the side with each message
     Price price;
@@ -470,6 +761,15 @@ struct OrderInfo {
 
 // --- Global Settings ---
 inline bool g_crossing_enabled = false;
+inline bool g_chunk_stats = false;  // Report chunks-per-event / unused bytes for 64B and 128B geometry
+inline bool g_pack_chunks = false;  // Pack small events from several tokens into shared chunks
+inline size_t g_conflate_threshold = 0;  // Conflate when more chunks than this are queued (0 = off)
+inline bool g_columnar_bench = false;  // Shadow receiver books with ColumnarBook, profile and cross-check
+inline bool g_top_only = false;  // Deliver only events touching level 0, apply the rest lazily
+inline bool g_analytics_check = false;  // Recompute BookAnalytics from the book after every event
+inline size_t g_history_events = 0;  // Per-token lookback depth for Runner::book_at (0 = off)
+inline bool g_history_check = false;  // Cross-check history lookbacks against live book copies
+inline uint64_t g_cold_after_ns = 0;  // Compact books idle this long (0 = all stay hot)
 
 // Pending cross info for self-trade detection
 // When a crossing order is active, we track it here so cancel_order can detect self-trades
@@ -494,6 +794,145 @@ struct CrossFill {
     Count count;  // order count at level when consumed (needed if level deleted at qty=0)
 };
 
+// --- Instrument Arena ---
+// bytes of 2MB-aligned anonymous memory (a multiple of 2MB): MAP_HUGETLB when huge pages are
+// reserved, otherwise a THP-advised mapping. Null if even the fallback can't be mapped.
+static void* map_huge_pages(size_t bytes, bool& huge_tlb) {
+    constexpr size_t kHugePage = size_t(2) << 20;
+    // No MAP_NORESERVE here: the reservation must fail now rather than SIGBUS on touch
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        huge_tlb = true;
+        return p;
+    }
+    // No reserved huge pages: over-map, trim to a 2MB-aligned range and ask for THP
+    huge_tlb = false;
+    p = mmap(nullptr, bytes + kHugePage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    char* raw = static_cast<char*>(p);
+    char* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(raw) + kHugePage - 1) & ~(kHugePage - 1));
+    if (aligned > raw) munmap(raw, aligned - raw);
+    if (raw + kHugePage > aligned) munmap(aligned + bytes, raw + kHugePage - aligned);
+    madvise(aligned, bytes, MADV_HUGEPAGE);
+    return aligned;
+}
+
+// Process-wide arena for per-instrument state (MBO objects, level arrays, order tables)
+// on 2MB pages: MAP_HUGETLB when huge pages are reserved, otherwise a THP-advised
+// mapping. A burst across many instruments then touches a handful of TLB entries instead
+// of one 4KB page per container. Freed blocks are recycled through power-of-two size
+// classes; larger requests go to the heap. Allocation only happens on instrument
+// creation and container growth, so one spinlock lets shard workers share the arena
+// (and a migrated book free into it from its new thread).
+class HugePageArena {
+public:
+    static HugePageArena& instance() {
+        static HugePageArena arena;
+        return arena;
+    }
+    
+    void* allocate(size_t bytes) {
+        size_t cls = size_class(bytes);
+        if (cls > kMaxClass) return ::operator new(bytes);
+        
+        Lock lock(lock_);
+        if (FreeBlock* block = free_[cls]) {
+            free_[cls] = block->next;
+            return block;
+        }
+        size_t size = size_t(1) << cls;
+        if (cursor_ + size > region_end_) map_region(size);
+        void* p = cursor_;
+        cursor_ += size;
+        return p;
+    }
+    
+    void deallocate(void* p, size_t bytes) {
+        size_t cls = size_class(bytes);
+        if (cls > kMaxClass) return ::operator delete(p);
+        
+        Lock lock(lock_);
+        FreeBlock* block = static_cast<FreeBlock*>(p);
+        block->next = free_[cls];
+        free_[cls] = block;
+    }
+    
+    // Each region falls back independently, so the backing is reported per byte
+    size_t huge_tlb_bytes() const { return huge_tlb_bytes_; }  // MAP_HUGETLB
+    size_t thp_bytes() const { return mapped_bytes_ - huge_tlb_bytes_; }  // THP advice
+    size_t mapped_bytes() const { return mapped_bytes_; }
+
+private:
+    static constexpr size_t kMinClass = 6;   // 64B: cache-line aligned blocks
+    static constexpr size_t kMaxClass = 24;  // 16MB
+    static constexpr size_t kRegionBytes = size_t(64) << 20;  // Mapped per growth step
+    static constexpr size_t kHugePage = size_t(2) << 20;
+    
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    struct Lock {
+        std::atomic_flag& flag;
+        explicit Lock(std::atomic_flag& f) : flag(f) {
+            while (flag.test_and_set(std::memory_order_acquire)) _mm_pause();
+        }
+        ~Lock() { flag.clear(std::memory_order_release); }
+    };
+    
+    HugePageArena() = default;
+    
+    static size_t size_class(size_t bytes) {
+        size_t cls = kMinClass;
+        while ((size_t(1) << cls) < bytes) ++cls;
+        return cls;
+    }
+    
+    // The tail of the previous region is abandoned; regions live until process exit
+    void map_region(size_t min_bytes) {
+        size_t bytes = std::max(kRegionBytes, (min_bytes + kHugePage - 1) & ~(kHugePage - 1));
+        bool huge_tlb;
+        void* p = map_huge_pages(bytes, huge_tlb);
+        always_assert(p && "instrument arena mmap failed");
+        cursor_ = static_cast<char*>(p);
+        region_end_ = cursor_ + bytes;
+        mapped_bytes_ += bytes;
+        if (huge_tlb) huge_tlb_bytes_ += bytes;
+    }
+    
+    std::atomic_flag lock_ = ATOMIC_FLAG_INIT;
+    FreeBlock* free_[kMaxClass + 1] = {};
+    char* cursor_ = nullptr;
+    char* region_end_ = nullptr;
+    size_t mapped_bytes_ = 0;
+    size_t huge_tlb_bytes_ = 0;
+};
+
+inline HugePageArena* g_instrument_arena = nullptr;  // --hugepages: default arena for new Runners
+
+// Stateful STL allocator over the arena; a null arena means the regular heap
+template<typename T>
+struct ArenaAllocator {
+    using value_type = T;
+    
+    HugePageArena* arena = nullptr;
+    
+    ArenaAllocator() = default;
+    explicit ArenaAllocator(HugePageArena* a) : arena(a) {}
+    template<typename U> ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+    
+    // Arena blocks are 64-byte aligned; the heap path honours over-aligned types
+    T* allocate(size_t n) {
+        if (arena) return static_cast<T*>(arena->allocate(n * sizeof(T)));
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+    }
+    void deallocate(T* p, size_t n) {
+        if (arena) arena->deallocate(p, n * sizeof(T));
+        else ::operator delete(p, std::align_val_t(alignof(T)));
+    }
+    
+    template<typename U> bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+};
+
 // --- PriceLevels ---
 /*
  * PRICE NEGATION FOR UNIFIED ORDERING (IMPLEMENTED)
@@ -548,16 +987,44 @@ struct CrossFill {
  */
 class PriceLevels {
 public:
-    using MapType = boost::container::flat_map<Price, pair<AggQty, Count>, std::greater<Price>>;
+    using MapType = boost::container::flat_map<Price, pair<AggQty, Count>, std::greater<Price>,
+                                               ArenaAllocator<std::pair<Price, pair<AggQty, Count>>>>;
+    using CrossFills = std::vector<CrossFill, ArenaAllocator<CrossFill>>;
 
-    PriceLevels(bool is_ask) 
+    PriceLevels(bool is_ask, HugePageArena* arena = nullptr) 
         : is_ask_(is_ask)
         , side_multiplier_(is_ask ? 1 : -1)
+        , levels_(MapType::allocator_type(arena))
         , emitter_(nullptr) 
+        , cross_fills_(CrossFills::allocator_type(arena))
     {
+        reserve_hot();
+    }
+    
+    // Residency tiers: hot capacities vs fit-to-contents for an idle book
+    void reserve_hot() {
         levels_.reserve(1000);
         cross_fills_.reserve(4);  // Typically cross ≤4 levels
     }
+    void shrink() {
+        levels_.shrink_to_fit();
+        cross_fills_.shrink_to_fit();
+    }
+    
+    // Pre-session: size for the expected level count and write every reserved slot so
+    // its pages are faulted in before the open; reset() empties the side, keeping capacity
+    void presize(size_t levels) { levels_.reserve(levels); }
+    void prefault() {
+        size_t n = levels_.capacity();
+        for (size_t i = 0; i < n; ++i) levels_.emplace_hint(levels_.end(), Price(n - i), std::make_pair(AggQty(0), Count(0)));
+        levels_.clear();
+    }
+    void reset() {
+        levels_.clear();
+        cross_fills_.clear();
+        pending_cross_fill_qty_ = 0;
+        pending_cross_fill_count_ = 0;
+    }
     
     void set_emitter(DeltaEmitter* e) {
         emitter_ = e;
@@ -660,6 +1127,8 @@ public:
     // Consume liquidity from best prices toward aggressor price
     // Called BEFORE adding aggressive order. Returns total qty consumed.
     // Tracks per-level consumption in cross_fills_ for rollback support.
+    // Fully consumed levels go out as one Sweep (with refills) instead of per-level
+    // Update(→0) + refill Insert; a partially consumed last level is an Update at 0.
     Qty cross(Price aggressor_price, Qty aggressor_qty) {
         if (!g_crossing_enabled) return 0;
         
@@ -673,6 +1142,8 @@ public:
         
         Qty consumed = 0;
         Qty remaining = aggressor_qty;
+        int swept = 0;       // Levels fully consumed (erased) from the touch
+        Qty partial = 0;     // Qty taken from the next level without emptying it
         
         while (remaining > 0 && !levels_.empty()) {
             Price best = best_price();
@@ -694,12 +1165,35 @@ public:
             pending_cross_fill_count_ += count;
             
             // Remove from level with count_delta=0 (will be fixed by trades)
-            remove_liquidity(best, consume, 0);
+            if (consume < qty) {
+                qty -= consume;
+                partial = consume;
+            } else {
+                levels_.erase(std::prev(levels_.end()));
+                ++swept;
+            }
             
             consumed += consume;
             remaining -= consume;
         }
         
+        if (swept > 0) {
+            // Refills are whatever now occupies the freed tail of the visible book
+            OutputLevel refills[20];
+            int num_refills = 0;
+            int size = static_cast<int>(levels_.size());
+            for (int idx = 20 - std::min(swept, 20); idx < 20 && idx < size; ++idx) {
+                const auto& [price, level] = *(levels_.end() - 1 - idx);
+                refills[num_refills++] = {price * side_multiplier_, static_cast<int32_t>(level.first), level.second};
+            }
+            emitter_->emit_sweep(is_ask_, swept, std::span<const OutputLevel>(refills, num_refills));
+        }
+        // With 20+ levels swept the partial level is refill row 0 and already carries its
+        // reduced qty, so a separate Update would subtract the partial fill twice
+        if (partial > 0 && swept < 20) {
+            emitter_->emit_update(is_ask_, 0, -partial, 0);
+        }
+        
         pending_cross_fill_qty_ += consumed;
         return consumed;
     }
@@ -776,8 +1270,16 @@ public:
     }
     
     // Access cross fills for partial rollback calculations
-    const std::vector<CrossFill>& cross_fills() const { return cross_fills_; }
+    const CrossFills& cross_fills() const { return cross_fills_; }
 
+    // Interleaved execution: pull the best levels' cache lines in ahead of use
+    void prefetch_top() const {
+        if (levels_.empty()) return;
+        const auto* best = &*levels_.rbegin();
+        __builtin_prefetch(best);
+        __builtin_prefetch(reinterpret_cast<const char*>(best) - 64);
+    }
+    
     Price best_price() const {
         if (levels_.empty()) return 0;
         // Best price now at rbegin() (descending order), denegate to return actual price
@@ -793,6 +1295,17 @@ public:
         int idx = static_cast<int>(levels_.size()) - 1 - static_cast<int>(it - levels_.begin());
         return (idx >= 20) ? 20 : static_cast<int8_t>(idx);
     }
+    
+    // Copy up to 20 best levels (actual prices, best first); returns number filled
+    int top_levels(OutputLevel* out) const {
+        int n = 0;
+        for (auto it = levels_.rbegin(); it != levels_.rend() && n < 20; ++it, ++n) {
+            out[n].price = it->first * side_multiplier_;
+            out[n].qty = static_cast<int32_t>(it->second.first);
+            out[n].num_orders = it->second.second;
+        }
+        return n;
+    }
 
 // TEMP private:
     bool is_ask_;
@@ -803,24 +1316,34 @@ public:
     // Crossing state
     Qty pending_cross_fill_qty_ = 0;  // Qty consumed by crosses, awaiting trade reconciliation
     Count pending_cross_fill_count_ = 0;  // Order count across pending (unconfirmed) fills
-    std::vector<CrossFill> cross_fills_;  // Per-level consumption for rollback support
+    CrossFills cross_fills_;  // Per-level consumption for rollback support
 };
 
 // --- MBO ---
 class MBO {
     friend class Runner;  // For accessing order_map_ to count active orders
 public:
-    MBO(Token token) 
+    // The emitter belongs to the Runner: only one event is built at a time and its chunks
+    // are copied out right after, so a per-instrument 1.3KB buffer would only take up cache
+    // space.
+    //
+    // arena (nullptr = heap) backs the level arrays and the order table.
+    MBO(Token token, DeltaEmitter* emitter, HugePageArena* arena = nullptr) 
         : token_(token)
-        , bids_(false)  // is_ask = false
-        , asks_(true)   // is_ask = true
+        , bids_(false, arena)  // is_ask = false
+        , asks_(true, arena)   // is_ask = true
+        , order_map_(OrderMap::allocator_type(arena))
     {
         // TODO analyze whether reserving more makes performance *much* worse on prod as well for 20k input
-        order_map_.reserve(1000);
-        
-        // Wire up delta emission
-        bids_.set_emitter(&emitter_);
-        asks_.set_emitter(&emitter_);
+        order_map_.reserve(kHotOrders);
+        set_emitter(emitter);
+    }
+    
+    // Wire up delta emission; also used when a migrated MBO joins another Runner
+    void set_emitter(DeltaEmitter* emitter) {
+        emitter_ = emitter;
+        bids_.set_emitter(emitter);
+        asks_.set_emitter(emitter);
     }
 
     void new_order(OrderId id, bool is_ask, Price price, Qty qty);
@@ -829,26 +1352,112 @@ public:
     void trade(OrderId buy_id, OrderId sell_id, Price price, Qty fill_qty);
     
     std::span<const DeltaChunk> get_delta_chunks() const {
-        return emitter_.get_chunks();
+        return emitter_->get_chunks();
+    }
+    
+    size_t delta_tail_bytes() const {
+        return emitter_->tail_bytes();
     }
     
     void prepare_deltas(Token token, uint32_t record_idx) {
-        emitter_.clear();
-        emitter_.set_event(token, record_idx);
+        emitter_->clear();
+        emitter_->set_event(token, record_idx);
+        best_before_[0] = bids_.best_price();
+        best_before_[1] = asks_.best_price();
     }
     
     void finalize_deltas() {
-        emitter_.finalize();
+        if (bids_.best_price() != best_before_[0]) emitter_->mark_best_price_changed(false);
+        if (asks_.best_price() != best_before_[1]) emitter_->mark_best_price_changed(true);
+        emitter_->finalize();
+    }
+    
+    // Replace the pending delta sequence with a bootstrap snapshot of the current book.
+    // Tagged with the last prepared record_idx. Crossing state is not carried, so callers
+    // should only snapshot when no cross is pending.
+    void emit_snapshot(Price tick_size) {
+        OutputLevel bids[20], asks[20];
+        int num_bids = bids_.top_levels(bids);
+        int num_asks = asks_.top_levels(asks);
+        emitter_->clear();
+        emitter_->emit_snapshot(tick_size, std::span<const OutputLevel>(bids, num_bids),
+                               std::span<const OutputLevel>(asks, num_asks));
+        emitter_->finalize();
+    }
+    
+    bool cross_pending() const { return pending_cross_.is_active(); }
+    
+    // Residency tiers (--cold-after): an idle book is compacted to fit its contents and
+    // gets its hot capacities back right before its next event
+    bool is_cold() const { return cold_; }
+    uint64_t last_active_ns() const { return last_active_ns_; }
+    void touch(uint64_t now_ns) { last_active_ns_ = now_ns; }
+    void make_cold() {
+        order_map_.rehash(0);
+        bids_.shrink();
+        asks_.shrink();
+        cold_ = true;
+    }
+    void rehydrate() {
+        order_map_.reserve(kHotOrders);
+        bids_.reserve_hot();
+        asks_.reserve_hot();
+        cold_ = false;
+    }
+    
+    // Pre-session warm-up: size from contract hints (0 = keep the defaults), fault in the
+    // reserved memory, and return to an empty book after synthetic traffic
+    void presize(size_t orders, size_t levels) {
+        if (orders) order_map_.reserve(orders);
+        if (levels) {
+            bids_.presize(levels);
+            asks_.presize(levels);
+        }
+    }
+    void prefault() {
+        // Fill to the reserved load so no rehash happens, then clear (capacity is kept)
+        size_t orders = static_cast<size_t>(order_map_.bucket_count() * order_map_.max_load_factor());
+        for (size_t i = 0; i < orders; ++i) order_map_.emplace(OrderId(-1) - OrderId(i), OrderInfo{});
+        order_map_.clear();
+        bids_.prefault();
+        asks_.prefault();
+    }
+    void reset() {
+        order_map_.clear();
+        bids_.reset();
+        asks_.reset();
+        last_order_id_ = 0;
+        pending_cross_.clear();
+        best_before_[0] = best_before_[1] = 0;
+    }
+    
+    // Interleaved execution: stage 1 pulls in the members an event touches first, stage 2
+    // (once those are cached) the best levels they point to
+    void prefetch_members() const {
+        __builtin_prefetch(&bids_);
+        __builtin_prefetch(&asks_);
+        __builtin_prefetch(&order_map_);
+    }
+    void prefetch_levels() const {
+        bids_.prefetch_top();
+        asks_.prefetch_top();
     }
 
 private:
+    static constexpr size_t kHotOrders = 1000;
+    
     Token token_;
-    DeltaEmitter emitter_;
+    DeltaEmitter* emitter_;
     PriceLevels bids_;
     PriceLevels asks_;
-    boost::unordered::unordered_flat_map<OrderId, OrderInfo> order_map_;
+    using OrderMap = boost::unordered::unordered_flat_map<OrderId, OrderInfo, boost::hash<OrderId>, std::equal_to<OrderId>,
+                                                          ArenaAllocator<std::pair<const OrderId, OrderInfo>>>;
+    OrderMap order_map_;
     OrderId last_order_id_ = 0;  // Track most recent new/modify for aggressor detection in trades
     PendingCross pending_cross_;  // Track active crossing for self-trade detection
+    Price best_before_[2] = {0, 0};  // [bid, ask] best prices when the event started
+    uint64_t last_active_ns_ = 0;
+    bool cold_ = false;
 };
 
 void MBO::new_order(OrderId id, bool is_ask, Price price, Qty qty) {
@@ -871,7 +1480,7 @@ void MBO::new_order(OrderId id, bool is_ask, Price price, Qty qty) {
     
     char tick_type = would_cross ? 'A' : 'N';  // A=newOrderCross, N=newOrderMsg
     bool is_exch_tick = !would_cross;
-    emitter_.emit_tick_info(tick_type, is_ask, is_exch_tick, price, qty, id);
+    emitter_->emit_tick_info(tick_type, is_ask, is_exch_tick, price, qty, id);
     
     // Now do the actual crossing (emits deltas)
     Qty consumed = passive.cross(price, qty);
@@ -926,7 +1535,7 @@ void MBO::modify_order(OrderId id, Price new_price, Qty new_qty) {
     // we could peek at whether crossing would occur. For now, simplified approach:
     // Always use non-crossing path if crossing disabled
     if (!g_crossing_enabled) {
-        emitter_.emit_tick_info('M', info.is_ask, true, new_price, new_qty, id);
+        emitter_->emit_tick_info('M', info.is_ask, true, new_price, new_qty, id);
         
         if (info.price != new_price) {
             own_side.remove_liquidity(info.price, info.qty, 1);
@@ -951,7 +1560,7 @@ void MBO::modify_order(OrderId id, Price new_price, Qty new_qty) {
     
     char tick_type = would_cross ? 'B' : 'M';
     bool is_exch_tick = !would_cross;
-    emitter_.emit_tick_info(tick_type, info.is_ask, is_exch_tick, new_price, new_qty, id);
+    emitter_->emit_tick_info(tick_type, info.is_ask, is_exch_tick, new_price, new_qty, id);
     
     // Get the affected level BEFORE removing (might be gone after)
     int8_t original_affected_lvl = own_side.get_level_index(info.price);
@@ -992,7 +1601,7 @@ void MBO::cancel_order(OrderId id) {
     
     if (it == order_map_.end()) {
         // Order not found - emit TickInfo with exchange data
-        emitter_.emit_tick_info('X', false, true, 0, 0, id);
+        emitter_->emit_tick_info('X', false, true, 0, 0, id);
         return;
     }
 
@@ -1017,7 +1626,7 @@ void MBO::cancel_order(OrderId id) {
         
         // C tick = VWAP of pending speculative fills, total pending qty
         auto [cross_vwap, cross_qty] = passive_side.pending_cross_vwap();
-        emitter_.emit_tick_info('C', info.is_ask, true, cross_vwap, cross_qty, id);
+        emitter_->emit_tick_info('C', info.is_ask, true, cross_vwap, cross_qty, id);
         
         // Calculate residual BEFORE uncross modifies state
         Qty unconfirmed = passive_side.pending_cross_fill_qty();
@@ -1032,10 +1641,10 @@ void MBO::cancel_order(OrderId id) {
         }
         
         // Emit S tick with aggressor's actual info (receiver captures for C expansion)
-        emitter_.emit_tick_info('S', info.is_ask, false, info.price, info.qty, id);
+        emitter_->emit_tick_info('S', info.is_ask, false, info.price, info.qty, id);
         
         // Emit CrossingComplete and clear crossing state
-        emitter_.emit_crossing_complete();
+        emitter_->emit_crossing_complete();
         passive_side.clear_cross_fills();
         pending_cross_.clear();
         
@@ -1062,13 +1671,13 @@ void MBO::cancel_order(OrderId id) {
             
             if (consumed_from_order == 0) {
                 // Order wasn't actually consumed - treat as regular cancel
-                emitter_.emit_tick_info('X', info.is_ask, false, info.price, info.qty, id);
+                emitter_->emit_tick_info('X', info.is_ask, false, info.price, info.qty, id);
                 half.remove_liquidity(info.price, info.qty, 1);
             } else {
                 // Self-trade cancel with actual consumption
                 // C tick = aggressor's POV: VWAP of pending speculative fills, total pending qty
                 auto [cross_vwap, cross_qty] = passive_side.pending_cross_vwap();
-                emitter_.emit_tick_info('C', info.is_ask, true, cross_vwap, cross_qty, id, pending_cross_.aggressor_id);
+                emitter_->emit_tick_info('C', info.is_ask, true, cross_vwap, cross_qty, id, pending_cross_.aggressor_id);
                 
                 // Remove remaining visible portion from level
                 Qty remaining_on_level = info.qty - consumed_from_order;
@@ -1091,18 +1700,18 @@ void MBO::cancel_order(OrderId id) {
                 }
                 
                 // Emit S tick with full cancelled order qty (receiver captures for C expansion)
-                emitter_.emit_tick_info('S', info.is_ask, false, info.price, info.qty, id, pending_cross_.aggressor_id);
+                emitter_->emit_tick_info('S', info.is_ask, false, info.price, info.qty, id, pending_cross_.aggressor_id);
                 
                 // If no more pending speculative consumption, crossing is complete
                 if (passive_side.pending_cross_fill_qty() == 0) {
-                    emitter_.emit_crossing_complete();
+                    emitter_->emit_crossing_complete();
                     passive_side.clear_cross_fills();
                     pending_cross_.clear();
                 }
             }
         } else {
             // Regular cancel (not during crossing, or not related to crossing)
-            emitter_.emit_tick_info('X', info.is_ask, false, info.price, info.qty, id);
+            emitter_->emit_tick_info('X', info.is_ask, false, info.price, info.qty, id);
             half.remove_liquidity(info.price, info.qty, 1);
         }
     }
@@ -1129,7 +1738,7 @@ void MBO::trade(OrderId bid_id, OrderId ask_id, Price price, Qty fill_qty) {
     // Tick type: 'D' = IOC (id=0), 'E' = market order (id!=0 but not in book), 'T' = normal
     char tick_type = (aggressor_id == 0) ? 'D' : (aggressor_it == order_map_.end() ? 'E' : 'T');
     
-    emitter_.emit_tick_info(tick_type, aggressor_is_ask, true, price, fill_qty, bid_id, ask_id);
+    emitter_->emit_tick_info(tick_type, aggressor_is_ask, true, price, fill_qty, bid_id, ask_id);
 
     // Reconcile against passive side - this qty was already removed from levels during crossing
     PriceLevels& passive = aggressor_is_ask ? bids_ : asks_;
@@ -1138,8 +1747,8 @@ void MBO::trade(OrderId bid_id, OrderId ask_id, Price price, Qty fill_qty) {
     
     // If we reconciled a crossing, emit synthetic zero-delta updates to set affected_lvl=0 on both sides
     if (reconciled > 0) {
-        emitter_.emit_update(!aggressor_is_ask, 0, 0, 0);  // passive side, level 0, no change
-        emitter_.emit_update(aggressor_is_ask, 0, 0, 0);   // aggressor side, level 0, no change
+        emitter_->emit_update(!aggressor_is_ask, 0, 0, 0);  // passive side, level 0, no change
+        emitter_->emit_update(aggressor_is_ask, 0, 0, 0);   // aggressor side, level 0, no change
     }
     
     for (auto it: {bid_it, ask_it}) {
@@ -1189,24 +1798,102 @@ void MBO::trade(OrderId bid_id, OrderId ask_id, Price price, Qty fill_qty) {
             if (!has_residual && pending_cross_.residual_tick_type == 'M') {
                 // Fully consumed from MODIFY - emit X tick directly using ORIGINAL resting price
                 // This ensures the X tick references where the order WAS before modify
-                emitter_.emit_tick_info('X', pending_cross_.aggressor_is_ask, false,
+                emitter_->emit_tick_info('X', pending_cross_.aggressor_is_ask, false,
                                        pending_cross_.original_resting_price, 
                                        pending_cross_.aggressor_original_qty,
                                        pending_cross_.aggressor_id, 0);
                 // Emit zero-delta update at original level to set affected_lvl correctly
                 // (must come AFTER X TickInfo so receiver associates it with X)
-                emitter_.emit_update(pending_cross_.aggressor_is_ask, 
+                emitter_->emit_update(pending_cross_.aggressor_is_ask, 
                                     pending_cross_.original_affected_lvl, 0, 0);
             } else if (has_residual || pending_cross_.residual_tick_type == 'N') {
                 // Either has residual (emit N/M) or fully consumed new order (no X needed)
                 // Let receiver synthesize via CrossingComplete
-                emitter_.emit_crossing_complete();
+                emitter_->emit_crossing_complete();
             }
             pending_cross_.clear();
         }
     }
 }
 
+// --- Chunk Geometry Report ---
+// Re-packs an event's delta sequence into a hypothetical payload size using the emitter's
+// rules (fixed deltas never split, snapshot rows stream), so a single run reports both
+// geometries from real data regardless of the compiled MBO_CHUNK_BYTES.
+template<size_t Payload>
+struct ChunkPacking {
+    size_t chunks = 0;
+    size_t offset = Payload;  // Forces a new chunk for the first delta
+    size_t used = 0;
+    
+    void add_delta(size_t bytes) {
+        if (offset + bytes > Payload) { ++chunks; offset = 0; }
+        offset += bytes;
+        used += bytes;
+    }
+    
+    void add_stream(size_t bytes) {
+        used += bytes;
+        while (bytes > 0) {
+            if (offset == Payload) { ++chunks; offset = 0; }
+            size_t take = std::min(bytes, Payload - offset);
+            offset += take;
+            bytes -= take;
+        }
+    }
+    
+    size_t waste() const { return chunks * Payload - used; }
+};
+
+template<typename ChunkT>
+void report_chunk_geometry(std::span<const ChunkT> chunks) {
+    ChunkPacking<BasicDeltaChunk<64>::PAYLOAD> geom64;
+    ChunkPacking<BasicDeltaChunk<128>::PAYLOAD> geom128;
+    auto add_delta = [&](size_t bytes) { geom64.add_delta(bytes); geom128.add_delta(bytes); };
+    
+    for (const auto& chunk : chunks) {
+        if (chunk.flags & ChunkContinuation) continue;
+        size_t offset = 0;
+        for (uint8_t i = 0; i < chunk.num_deltas && offset < ChunkT::PAYLOAD; ++i) {
+            uint8_t dtype = chunk.payload[offset];
+            size_t bytes = 0;
+            switch (dtype) {
+                case DeltaType::TickInfo: bytes = sizeof(TickInfoDelta); break;
+                case DeltaType::Update: bytes = sizeof(UpdateDelta); break;
+                case DeltaType::Insert: bytes = sizeof(InsertDelta); break;
+                case DeltaType::CrossingComplete: bytes = sizeof(CrossingCompleteDelta); break;
+                // Pieces are taken as emitted for the compiled geometry (a larger chunk
+                // would split less), so the other geometry's numbers are a slight overestimate
+                case DeltaType::Sweep:
+                    bytes = reinterpret_cast<const SweepDelta*>(&chunk.payload[offset])->size();
+                    break;
+                case DeltaType::Snapshot: {
+                    const SnapshotDelta* snap = reinterpret_cast<const SnapshotDelta*>(&chunk.payload[offset]);
+                    add_delta(sizeof(SnapshotDelta));
+                    size_t rows = snap->side_bytes(snap->bid_levels) + snap->side_bytes(snap->ask_levels);
+                    geom64.add_stream(rows);
+                    geom128.add_stream(rows);
+                    break;  // Rows fill the rest of the sequence; bytes stays 0 to end the scan
+                }
+            }
+            if (bytes == 0) break;
+            add_delta(bytes);
+            offset += bytes;
+        }
+    }
+    
+    // Simulation of the compiled geometry must agree with what the emitter actually produced
+    if constexpr (sizeof(ChunkT) == 64) always_assert(geom64.chunks == chunks.size());
+    if constexpr (sizeof(ChunkT) == 128) always_assert(geom128.chunks == chunks.size());
+    
+    PerfProfileCount("geom64_chunks_per_event", geom64.chunks);
+    PerfProfileCount("geom64_unused_bytes", geom64.waste());
+    PerfProfileCount("geom64_multi_chunk_events", geom64.chunks > 1);
+    PerfProfileCount("geom128_chunks_per_event", geom128.chunks);
+    PerfProfileCount("geom128_unused_bytes", geom128.waste());
+    PerfProfileCount("geom128_multi_chunk_events", geom128.chunks > 1);
+}
+
 // --- Delta Reconstruction (for validation) ---
 
 // Pending aggressor state for receiver-side C/S/N expansion and CrossingComplete handling
@@ -1237,449 +1924,2720 @@ struct PendingAggressorState {
     }
 };
 
-// TODO when finalizing chunk push/pop/peek interfaces, consider that any tick info
-// delta will be the first if present and only loop over the rest - perhaps there's
-// a neater iterator pattern that we'll be able to use; could also standardize the
-// flags and combine the update/insert loop to setup_args/maybe_shift/add/maybe_erase
-// Returns the number of OutputRecords produced (usually 1, but 3 for 'C' tick)
-int apply_deltas_to_book(OutputRecord& rec, std::span<const DeltaChunk> chunks, 
-                          PendingAggressorState& agg_state, 
-                          std::vector<OutputRecord>* extra_records = nullptr) {
-    // Track first delta index on each side for affected_lvl reconstruction
-    uint8_t affected_lvl[2] = {20, 20};  // [bid, ask], 20 = not affected
-    bool seen_tick_info = false;  // Track if we've processed a TickInfoDelta
-    Qty self_trade_cancel_full_qty = 0;   // Full order qty from explicit S tick (for C expansion)
-    Price self_trade_cancel_price = 0;    // Passive order's actual price from explicit S tick
+// Sequential reader over a payload byte stream that spans continuation chunks
+template<typename ChunkT>
+struct PayloadReader {
+    static constexpr size_t PAYLOAD = ChunkT::PAYLOAD;
+    const ChunkT* chunk;
+    const ChunkT* end;
+    size_t offset;
+    
+    void read(void* dst, size_t n) {
+        uint8_t* out = static_cast<uint8_t*>(dst);
+        while (n > 0) {
+            if (offset == PAYLOAD) [[unlikely]] {
+                ++chunk;
+                offset = 0;
+                always_assert(chunk != end && (chunk->flags & ChunkContinuation));
+            }
+            size_t take = std::min(n, PAYLOAD - offset);
+            memcpy(out, &chunk->payload[offset], take);
+            offset += take;
+            out += take;
+            n -= take;
+        }
+    }
+};
 
-    PerfProfile("apply_deltas_to_book");
-    // Process all chunks
+// Bootstrap fast path: decode both sides wholesale into 20-level arrays (unused levels
+// zeroed). Absolute rows are OutputLevel layout, so each side is one memcpy per chunk segment.
+template<typename ChunkT>
+void decode_snapshot(OutputLevel* bids, OutputLevel* asks, const SnapshotDelta& snap, PayloadReader<ChunkT> reader) {
+    always_assert(snap.bid_levels <= 20 && snap.ask_levels <= 20);
+    
+    for (int is_ask = 0; is_ask < 2; ++is_ask) {
+        OutputLevel* book = is_ask ? asks : bids;
+        uint8_t levels = is_ask ? snap.ask_levels : snap.bid_levels;
+        
+        if (!snap.tick_rows()) {
+            reader.read(book, levels * sizeof(OutputLevel));
+        } else if (levels > 0) {
+            reader.read(&book[0], sizeof(OutputLevel));
+            Price step = is_ask ? snap.tick_size : -snap.tick_size;  // Away from the touch
+            for (int i = 1; i < levels; ++i) {
+                SnapshotTickRow row;
+                reader.read(&row, sizeof(row));
+                book[i].price = book[0].price + step * row.ticks;
+                book[i].qty = row.qty;
+                book[i].num_orders = row.num_orders;
+            }
+        }
+        memset(&book[levels], 0, (20 - levels) * sizeof(OutputLevel));
+    }
+}
+
+// Generic delta decoder: walks one event's chunks and hands each delta to the visitor, so
+// strategies can maintain their own book layout (SoA, top-N only, ...) without
+// materializing OutputRecords. The level hooks are required, since a visitor missing one
+// would silently drift from the publisher's book:
+//   on_update(bool is_ask, uint8_t idx, int64_t qty_delta, int32_t count_delta)
+//   on_insert(bool is_ask, uint8_t idx, bool shift, Price price, int64_t qty, int32_t count)
+//   on_sweep(bool is_ask, uint8_t levels, const OutputLevel* refills, uint8_t num_refills)
+//   on_snapshot(uint32_t record_idx, std::span<const OutputLevel> bids, std::span<const OutputLevel> asks)
+// Event metadata is optional; a visitor implements only what it needs:
+//   on_tick_info(const TickInfoDelta&)
+//   on_crossing_complete()
+//   OutputLevel* snapshot_levels(bool is_ask) - the visitor's own 20-level array for that
+//       side; snapshots decode straight into it and on_snapshot gets spans over it
+// Update/Insert/Sweep carry the same index semantics as DELTAS.md: Update to qty <= 0
+// deletes the level, Insert with shift pushes levels down, refills land without shift.
+template<typename V>
+concept DeltaVisitor = requires(V& visitor, bool is_ask, uint8_t idx, const OutputLevel* levels,
+                                std::span<const OutputLevel> side) {
+    visitor.on_update(is_ask, idx, int64_t{}, int32_t{});
+    visitor.on_insert(is_ask, idx, false, Price{}, int64_t{}, int32_t{});
+    visitor.on_sweep(is_ask, idx, levels, idx);
+    visitor.on_snapshot(uint32_t{}, side, side);
+};
+
+template<typename ChunkT, DeltaVisitor Visitor>
+void apply_deltas(std::span<const ChunkT> chunks, Visitor& visitor) {
     for (const auto& chunk : chunks) {
-        rec.token = chunk.token;
+        if (chunk.flags & ChunkContinuation) continue;  // Snapshot rows, consumed with their header
         
         size_t offset = 0;
-        for (uint8_t i = 0; i < chunk.num_deltas && offset < 58; ++i) {
+        for (uint8_t i = 0; i < chunk.num_deltas && offset < ChunkT::PAYLOAD; ++i) {
             uint8_t dtype = chunk.payload[offset];
             
             if (dtype == DeltaType::TickInfo) {
                 const TickInfoDelta* delta = reinterpret_cast<const TickInfoDelta*>(&chunk.payload[offset]);
-                
-                // S tick during active crossing: capture passive order's price/qty for C expansion
-                // Don't process as normal tick - C expansion will use these for S record
-                if (delta->tick_type == 'S' && agg_state.is_active()) {
-                    self_trade_cancel_full_qty = delta->qty;
-                    self_trade_cancel_price = delta->price;
-                    offset += sizeof(TickInfoDelta);
-                    continue;
-                }
-                
-                bool is_ask = (delta->exch_side_flags >> 1) & 1;
-                
-                // If we've already processed a TickInfoDelta, this is a secondary tick
-                // (e.g., N/M/X after T for residual/cancellation)
-                // Push the current record as an extra before processing the new one
-                if (seen_tick_info && extra_records != nullptr) {
-                    // Finalize current record with affected levels and filled counts
-                    rec.bid_affected_lvl = affected_lvl[0];
-                    rec.ask_affected_lvl = affected_lvl[1];
-                    rec.bid_filled_lvls = 0;
-                    rec.ask_filled_lvls = 0;
-                    for (int j = 0; j < 20; ++j) {
-                        if (rec.bids[j].price != 0) rec.bid_filled_lvls++;
-                        if (rec.asks[j].price != 0) rec.ask_filled_lvls++;
-                    }
-                    extra_records->push_back(rec);
-                    // Reset affected levels for secondary TickInfo (e.g., X tick after T)
-                    // Note: CrossingComplete-synthesized N/M keeps affected levels (handled separately)
-                    affected_lvl[0] = 20;
-                    affected_lvl[1] = 20;
-                }
-                seen_tick_info = true;
-                
-                // Copy event metadata (record_idx now in TickInfoDelta)
-                rec.record_idx = delta->record_idx;
-                rec.event.tick_type = delta->tick_type;
-                rec.event.is_ask = is_ask;
-                rec.event.price = delta->price;
-                rec.event.qty = delta->qty;
-                rec.event.order_id = delta->order_id;
-                rec.event.order_id2 = delta->order_id2;
-                rec.is_ask = is_ask;
-                
-                // Track aggressor state for 'A'/'B' ticks (crossing start)
-                if (delta->tick_type == 'A' || delta->tick_type == 'B') {
-                    agg_state.set(delta->order_id, is_ask, delta->price, delta->qty, delta->tick_type);
-                }
-                
-                // Update aggressor remaining on trades
-                // Note: don't clear here - CrossingComplete will signal when to synthesize N/M/X
-                if ((delta->tick_type == 'T' || delta->tick_type == 'D' || delta->tick_type == 'E') 
-                    && agg_state.is_active()) {
-                    agg_state.on_trade(delta->qty);
-                }
-                
-                // For trades, extract LTP/LTQ
-                if (delta->tick_type == 'T') {
-                    rec.ltp = delta->price;
-                    rec.ltq = delta->qty;
+                if constexpr (requires { visitor.on_tick_info(*delta); }) {
+                    visitor.on_tick_info(*delta);
                 }
-                
                 offset += sizeof(TickInfoDelta);
                 
             } else if (dtype == DeltaType::Update) {
                 const UpdateDelta* delta = reinterpret_cast<const UpdateDelta*>(&chunk.payload[offset]);
-                bool is_ask = unpack_side(delta->side_index);
-                uint8_t idx = unpack_index(delta->side_index);
-                
-                OutputLevel* book = is_ask ? rec.asks : rec.bids;
-                
-                // Track affected_lvl: use minimum (topmost) index among all updates
-                affected_lvl[is_ask] = std::min(affected_lvl[is_ask], idx);
-                
-                // Apply update
-                book[idx].qty += delta->qty_delta;
-                book[idx].num_orders += delta->count_delta;
-                
-                // Handle implicit deletion
-                if (book[idx].qty <= 0) {
-                    memmove(&book[idx], &book[idx+1], (19-idx) * sizeof(OutputLevel));
-                    memset(&book[19], 0, sizeof(OutputLevel));
-                }
-                
+                visitor.on_update(unpack_side(delta->side_index), unpack_index(delta->side_index),
+                                  delta->qty_delta, delta->count_delta);
                 offset += sizeof(UpdateDelta);
                 
             } else if (dtype == DeltaType::Insert) {
                 const InsertDelta* delta = reinterpret_cast<const InsertDelta*>(&chunk.payload[offset]);
-                bool is_ask = unpack_side(delta->side_index_shift);
-                uint8_t idx = unpack_index(delta->side_index_shift);
-                bool shift = unpack_shift(delta->side_index_shift);
-                
-                OutputLevel* book = is_ask ? rec.asks : rec.bids;
-
-                // Track affected_lvl: skip refills (shift=false), use minimum (topmost) non-refill delta
-                if (shift) {  // shift=true → real insertion, not refill
-                    affected_lvl[is_ask] = std::min(affected_lvl[is_ask], idx);
-                }
-                
-                // Apply insert
-                if (shift) {
-                    // Shift levels down before inserting
-                    memmove(&book[idx+1], &book[idx], (19-idx) * sizeof(OutputLevel));
-                }
-                
-                book[idx].price = delta->price;
-                book[idx].qty = delta->qty;
-                book[idx].num_orders = delta->count;
-                
+                visitor.on_insert(unpack_side(delta->side_index_shift), unpack_index(delta->side_index_shift),
+                                  unpack_shift(delta->side_index_shift), delta->price, delta->qty, delta->count);
                 offset += sizeof(InsertDelta);
                 
             } else if (dtype == DeltaType::CrossingComplete) {
-                // Crossing has fully resolved - synthesize N/M/X tick for the aggressor
-                // Skip synthesis if current tick is 'C' (self-trade) - 'C' expansion handles it
-                bool is_self_trade = (rec.event.tick_type == 'C');
-                if (extra_records != nullptr && agg_state.is_active() && !is_self_trade) {
-                    // Check if we need to synthesize a tick
-                    bool need_residual = (agg_state.aggressor_remaining > 0);
-                    bool need_cancel = (!need_residual && agg_state.original_tick_type == 'B');
-                    
-                    if (need_residual || need_cancel) {
-                        // Push current record (typically a T/D/E tick) to extra_records first
-                        // Finalize current record with affected levels and filled counts
-                        rec.bid_affected_lvl = affected_lvl[0];
-                        rec.ask_affected_lvl = affected_lvl[1];
-                        rec.bid_filled_lvls = 0;
-                        rec.ask_filled_lvls = 0;
-                        for (int j = 0; j < 20; ++j) {
-                            if (rec.bids[j].price != 0) rec.bid_filled_lvls++;
-                            if (rec.asks[j].price != 0) rec.ask_filled_lvls++;
-                        }
-                        extra_records->push_back(rec);
-                        
-                        // Synthesize the residual/cancel tick
-                        // Keep affected levels from T tick (same logical event)
-                        // Note: affected_lvl is NOT reset - N/M/X inherits from T
-                        
-                        if (need_residual) {
-                            // Aggressor has residual - emit N (from 'A') or M (from 'B')
-                            rec.event.tick_type = (agg_state.original_tick_type == 'A') ? 'N' : 'M';
-                            rec.event.is_ask = agg_state.aggressor_is_ask;
-                            rec.event.price = agg_state.aggressor_price;
-                            rec.event.qty = agg_state.aggressor_remaining;
-                            rec.event.order_id = agg_state.aggressor_id;
-                            rec.event.order_id2 = 0;
-                            rec.is_ask = agg_state.aggressor_is_ask;
-                        } else {
-                            // Fully consumed from MODIFY - emit X (order removed from book)
-                            rec.event.tick_type = 'X';
-                            rec.event.is_ask = agg_state.aggressor_is_ask;
-                            rec.event.price = agg_state.aggressor_price;
-                            rec.event.qty = agg_state.aggressor_original_qty;
-                            rec.event.order_id = agg_state.aggressor_id;
-                            rec.event.order_id2 = 0;
-                            rec.is_ask = agg_state.aggressor_is_ask;
-                        }
-                    }
-                    // For 'A' that fully consumed - no additional tick needed, rec stays as T/D/E
-                }
-                if (!is_self_trade) {
-                    agg_state.clear();
-                } else {
-                    // Self-trade: agg_state remains active for 'C' expansion at end,
-                    // but flag that crossing is complete so expansion can clear it
-                    agg_state.crossing_complete = true;
+                if constexpr (requires { visitor.on_crossing_complete(); }) {
+                    visitor.on_crossing_complete();
                 }
                 offset += sizeof(CrossingCompleteDelta);
                 
+            } else if (dtype == DeltaType::Sweep) {
+                const SweepDelta* delta = reinterpret_cast<const SweepDelta*>(&chunk.payload[offset]);
+                uint8_t levels = unpack_index(delta->side_levels);
+                always_assert(levels <= 20 && delta->num_refills <= levels);
+                visitor.on_sweep(unpack_side(delta->side_levels), levels,
+                                 reinterpret_cast<const OutputLevel*>(&chunk.payload[offset + sizeof(SweepDelta)]),
+                                 delta->num_refills);
+                offset += delta->size();
+                
+            } else if (dtype == DeltaType::Snapshot) {
+                // Standalone bootstrap sequence: rows fill the rest of this payload onwards
+                const SnapshotDelta* delta = reinterpret_cast<const SnapshotDelta*>(&chunk.payload[offset]);
+                PayloadReader<ChunkT> reader{&chunk, chunks.data() + chunks.size(), offset + sizeof(SnapshotDelta)};
+                OutputLevel scratch[2][20];
+                OutputLevel* bids = scratch[0];
+                OutputLevel* asks = scratch[1];
+                if constexpr (requires { { visitor.snapshot_levels(false) } -> std::same_as<OutputLevel*>; }) {
+                    bids = visitor.snapshot_levels(false);
+                    asks = visitor.snapshot_levels(true);
+                }
+                decode_snapshot(bids, asks, *delta, reader);
+                visitor.on_snapshot(delta->record_idx, std::span<const OutputLevel>(bids, delta->bid_levels),
+                                    std::span<const OutputLevel>(asks, delta->ask_levels));
+                break;
+                
             } else {
                 // Unknown delta type, skip
                 break;
             }
         }
     }
+}
+
+// Derived book quantities kept up to date from the delta stream: cumulative qty, order
+// count and notional (price * qty) over the top 1/5/10/20 levels of each side. Each
+// Update/Insert adjusts at most four sums per side using the level entering or leaving a
+// depth window, read from the book before the delta is applied; Sweep and Snapshot
+// (rare) recompute the side. Ratios are derived from the sums on request.
+class BookAnalytics {
+public:
+    static constexpr int kDepths[4] = {1, 5, 10, 20};
+    enum Depth { Top1 = 0, Top5 = 1, Top10 = 2, Top20 = 3 };
     
-    // Set affected_lvl fields
-    rec.bid_affected_lvl = affected_lvl[0];
-    rec.ask_affected_lvl = affected_lvl[1];
+    int64_t depth_qty(bool is_ask, Depth d) const { return sides_[is_ask].qty[d]; }
+    int64_t depth_count(bool is_ask, Depth d) const { return sides_[is_ask].count[d]; }
     
-    // Count filled levels
-    rec.bid_filled_lvls = 0;
-    rec.ask_filled_lvls = 0;
-    for (int i = 0; i < 20; ++i) {
-        if (rec.bids[i].price != 0) rec.bid_filled_lvls++;
-        if (rec.asks[i].price != 0) rec.ask_filled_lvls++;
+    // Size-weighted average price of the top levels of one side (0 if the side is empty)
+    double vwap(bool is_ask, Depth d) const {
+        const Side& side = sides_[is_ask];
+        return side.qty[d] > 0 ? static_cast<double>(side.notional[d]) / side.qty[d] : 0.0;
     }
     
-    // Handle 'C' tick expansion: generate S and N ticks using tracked aggressor state
-    if (rec.event.tick_type == 'C' && extra_records != nullptr && agg_state.is_active()) {
-        bool aggressor_side = agg_state.aggressor_is_ask;
-        
-        // Distinguish aggressor cancel vs passive cancel:
-        // - Aggressor cancel: cancelled order IS the aggressor (id matches)
-        // - Passive cancel: cancelled order is on the passive side (id doesn't match)
-        bool is_aggressor_cancel = (static_cast<OrderId>(rec.event.order_id) == agg_state.aggressor_id);
-        
-        if (is_aggressor_cancel) {
-            // Aggressor self-trade cancel: exchange cancelled the aggressor
-            // Emit C + S only (no N/B residual since aggressor is gone)
-            
-            // C tick: aggressor's side
-            rec.event.is_ask = aggressor_side;
-            rec.is_ask = aggressor_side;
-            rec.bid_affected_lvl = 0;
-            rec.ask_affected_lvl = 0;
-            
-            // S tick: aggressor's side (the cancelled order IS the aggressor)
-            OutputRecord rec_s = rec;
-            rec_s.event.tick_type = 'S';
-            rec_s.bid_affected_lvl = 20;
-            rec_s.ask_affected_lvl = 20;
-            if (self_trade_cancel_full_qty > 0) {
-                rec_s.event.price = self_trade_cancel_price;
-                rec_s.event.qty = self_trade_cancel_full_qty;
-            }
-            extra_records->push_back(rec_s);
-            
-            agg_state.clear();
-            return 2;  // C + S
-        } else {
-            // Passive self-trade cancel: cancelled order was on passive side
-            bool cancelled_side = !aggressor_side;
-            
-            // Fix the 'C' record to use aggressor's side
-            rec.event.is_ask = aggressor_side;
-            rec.is_ask = aggressor_side;
-            
-            // Self-trade cancels inherently affect top of book on both sides:
-            // the cancelled passive order was at/near best price (it was being crossed),
-            // and the aggressor rests on the other side. The speculative crossing already
-            // removed the passive level (no Update deltas in the chunk), so we set
-            // affected levels explicitly rather than relying on delta-derived values.
-            rec.bid_affected_lvl = 0;
-            rec.ask_affected_lvl = 0;
-            
-            // 'S' tick: cancelled order's perspective (cancelled order's side)
-            // Synthetic notification: no additional book changes, both affected levels = 20
-            // Price/qty from MBO's explicit S tick (passive order's actual info, not C's VWAP)
-            OutputRecord rec_s = rec;
-            rec_s.event.tick_type = 'S';
-            rec_s.event.is_ask = cancelled_side;
-            rec_s.is_ask = cancelled_side;
-            rec_s.bid_affected_lvl = 20;
-            rec_s.ask_affected_lvl = 20;
-            if (self_trade_cancel_full_qty > 0) {
-                rec_s.event.price = self_trade_cancel_price;
-                rec_s.event.qty = self_trade_cancel_full_qty;
-            }
-            extra_records->push_back(rec_s);
-            
-            // Tick type depends on whether crossing has been fully confirmed:
-            // - crossing_complete=false: still speculative, use original tick type ('A'/'B')
-            // - crossing_complete=true: confirmed, use residual type ('N'/'M')
-            OutputRecord rec_n = rec;
-            rec_n.event.tick_type = agg_state.crossing_complete
-                ? ((agg_state.original_tick_type == 'A') ? 'N' : 'M')
-                : agg_state.original_tick_type;
-            rec_n.event.is_ask = aggressor_side;
-            rec_n.event.price = agg_state.aggressor_price;
-            rec_n.event.qty = agg_state.aggressor_remaining;
-            rec_n.event.order_id = agg_state.aggressor_id;
-            rec_n.event.order_id2 = 0;
-            rec_n.is_ask = aggressor_side;
-            // Aggressor side: keep affected level from 'C' deltas (where add_liquidity happened)
-            // Other side: 20 (not affected)
-            if (aggressor_side) {  // ask aggressor
-                rec_n.bid_affected_lvl = 20;
-                // ask_affected_lvl already set from 'C' processing
-            } else {  // bid aggressor
-                rec_n.ask_affected_lvl = 20;
-                // bid_affected_lvl already set from 'C' processing
-            }
-            extra_records->push_back(rec_n);
-            
-            // Clear agg_state if crossing completed during this self-trade cancel
-            if (agg_state.crossing_complete) {
-                agg_state.clear();
-            }
-            // else: crossing continues, agg_state stays active for more trades
-            return 3;  // C + S + N
-        }
+    // (bid - ask) / (bid + ask) over the top levels; in [-1, 1], 0 for an empty book
+    double imbalance(Depth d) const {
+        int64_t bid = sides_[0].qty[d], ask = sides_[1].qty[d];
+        return bid + ask > 0 ? static_cast<double>(bid - ask) / static_cast<double>(bid + ask) : 0.0;
     }
     
-    return 1;  // Single record produced
-}
-
-// --- Book Observer (strategy callback interface) ---
-// In production: strategy process receives book snapshots via this interface
-class BookObserver {
-public:
+    // Each side's VWAP weighted by the opposite side's size; 0 unless both sides have levels
+    double weighted_mid(Depth d) const {
+        int64_t bid = sides_[0].qty[d], ask = sides_[1].qty[d];
+        if (bid == 0 || ask == 0) return 0.0;
+        return (vwap(false, d) * ask + vwap(true, d) * bid) / static_cast<double>(bid + ask);
+    }
+    
+    double microprice() const { return weighted_mid(Top1); }
+    
+    bool operator==(const BookAnalytics&) const = default;
+    
+    // Best ask - best bid; 0 unless both sides have levels
+    Price spread() const {
+        if (sides_[0].qty[Top1] == 0 || sides_[1].qty[Top1] == 0) return 0;
+        return sides_[1].notional[Top1] / sides_[1].qty[Top1] - sides_[0].notional[Top1] / sides_[0].qty[Top1];
+    }
+    
+    // --- Delta hooks (book = side's levels before the delta is applied) ---
+    
+    // Level idx changes in place by (qty_delta, count_delta) at its price
+    void on_level_change(bool is_ask, int idx, Price price, int64_t qty_delta, int64_t count_delta) {
+        add(sides_[is_ask], idx, qty_delta, count_delta, price * qty_delta);
+    }
+    
+    // Level idx is deleted; every window it was in gains the level shifted up past its end
+    void on_level_remove(bool is_ask, int idx, const OutputLevel* book) {
+        Side& side = sides_[is_ask];
+        for (int d = 0; d < 4; ++d) {
+            if (idx >= kDepths[d]) continue;
+            side.subtract(d, book[idx]);
+            if (kDepths[d] < 20) side.add(d, book[kDepths[d]]);
+        }
+    }
+    
+    // level lands at idx, shifting the levels below down (shift) or replacing book[idx]
+    void on_level_insert(bool is_ask, int idx, bool shift, const OutputLevel& level, const OutputLevel* book) {
+        Side& side = sides_[is_ask];
+        for (int d = 0; d < 4; ++d) {
+            if (idx >= kDepths[d]) continue;
+            side.subtract(d, book[shift ? kDepths[d] - 1 : idx]);
+            side.add(d, level);
+        }
+    }
+    
+    // Whole side replaced (sweep, snapshot): book = side's levels after the change
+    void rebuild(bool is_ask, const OutputLevel* book) {
+        Side& side = sides_[is_ask];
+        side = Side{};
+        for (int i = 0; i < 20 && book[i].price != 0; ++i) {
+            add(side, i, book[i].qty, book[i].num_orders, book[i].price * book[i].qty);
+        }
+    }
+
+private:
+    struct Side {
+        int64_t qty[4] = {};
+        int64_t count[4] = {};
+        int64_t notional[4] = {};
+        
+        void add(int d, const OutputLevel& level) {
+            qty[d] += level.qty;
+            count[d] += level.num_orders;
+            notional[d] += level.price * level.qty;
+        }
+        void subtract(int d, const OutputLevel& level) {
+            qty[d] -= level.qty;
+            count[d] -= level.num_orders;
+            notional[d] -= level.price * level.qty;
+        }
+        bool operator==(const Side&) const = default;
+    };
+    
+    static void add(Side& side, int idx, int64_t qty, int64_t count, int64_t notional) {
+        for (int d = 0; d < 4; ++d) {
+            if (idx >= kDepths[d]) continue;
+            side.qty[d] += qty;
+            side.count[d] += count;
+            side.notional[d] += notional;
+        }
+    }
+    
+    Side sides_[2];  // [bid, ask]
+};
+
+class BookHistory;
+
+// Destroys a BookHistory and hands its block back to the arena it came from
+struct BookHistoryDeleter {
+    HugePageArena* arena = nullptr;
+    void operator()(BookHistory* history) const;
+};
+using BookHistoryPtr = std::unique_ptr<BookHistory, BookHistoryDeleter>;
+
+// Per-token strategy-side state. The book's filled-level counts and analytics are
+// maintained incrementally by OutputRecordBuilder; unreported_changed holds level changes
+// applied without a delivered record (snapshot bootstrap, deferred events) so the next
+// BookView includes them.
+struct ReceiverState {
+    OutputRecord book{};
+    BookAnalytics analytics;
+    PendingAggressorState agg_state;
+    uint32_t unreported_changed[2] = {0, 0};  // [bid, ask]
+    std::vector<DeltaChunk> deferred;  // Top-only mode: undecoded events below level 0, in order
+    BookHistoryPtr history;  // Lookback ring (--history), created with the state by Runner::receiver_state
+};
+
+// Zero-copy view of one delivered record: points at the receiver's reconstructed book
+// and its analytics (valid only for the duration of the callback) plus which levels
+// changed since the previous view of this token. Bit i of bid_changed/ask_changed covers bids[i]/asks[i]; a shift or removal
+// marks every level from its index down.
+struct BookView {
+    static constexpr uint32_t kAllLevels = (1u << 20) - 1;
+    
+    const OutputRecord* book;
+    const BookAnalytics* analytics;
+    uint32_t bid_changed;
+    uint32_t ask_changed;
+    
+    Token token() const { return book->token; }
+    uint32_t record_idx() const { return book->record_idx; }
+    const InputRecord& event() const { return book->event; }
+};
+
+// Delta visitor that reconstructs the full OutputRecord, including receiver-side
+// crossing expansion (T+N/M/X on CrossingComplete, C+S+N on self-trade cancel).
+// Every record the event produces is passed to emit(const BookView&) in final delivery
+// order (T before a synthesized N/M/X, C before S/N). Records are staged in rec itself,
+// so nothing is copied or allocated; rec ends up holding the last one emitted.
+template<typename Sink>
+class OutputRecordBuilder {
+public:
+    OutputRecordBuilder(ReceiverState& state, Sink& emit)
+        : rec(state.book), analytics(state.analytics), agg_state(state.agg_state),
+          changed(state.unreported_changed), emit(emit) {}
+    
+    void on_tick_info(const TickInfoDelta& delta) {
+        // S tick during active crossing: capture passive order's price/qty for C expansion
+        // Don't process as normal tick - C expansion will use these for S record
+        if (delta.tick_type == 'S' && agg_state.is_active()) {
+            self_trade_cancel_full_qty = delta.qty;
+            self_trade_cancel_price = delta.price;
+            return;
+        }
+        
+        bool is_ask = (delta.exch_side_flags >> 1) & 1;
+        
+        // If we've already processed a TickInfoDelta, this is a secondary tick
+        // (e.g., N/M/X after T for residual/cancellation)
+        // Emit the current record before processing the new one
+        if (seen_tick_info) {
+            finalize_record();
+            emit_record();
+            // Reset affected levels for secondary TickInfo (e.g., X tick after T)
+            // Note: CrossingComplete-synthesized N/M keeps affected levels (handled separately)
+            affected_lvl[0] = 20;
+            affected_lvl[1] = 20;
+        }
+        seen_tick_info = true;
+        
+        // Copy event metadata (record_idx now in TickInfoDelta)
+        rec.record_idx = delta.record_idx;
+        rec.event.tick_type = delta.tick_type;
+        rec.event.is_ask = is_ask;
+        rec.event.price = delta.price;
+        rec.event.qty = delta.qty;
+        rec.event.order_id = delta.order_id;
+        rec.event.order_id2 = delta.order_id2;
+        rec.is_ask = is_ask;
+        
+        // Track aggressor state for 'A'/'B' ticks (crossing start)
+        if (delta.tick_type == 'A' || delta.tick_type == 'B') {
+            agg_state.set(delta.order_id, is_ask, delta.price, delta.qty, delta.tick_type);
+        }
+        
+        // Update aggressor remaining on trades
+        // Note: don't clear here - CrossingComplete will signal when to synthesize N/M/X
+        if ((delta.tick_type == 'T' || delta.tick_type == 'D' || delta.tick_type == 'E') 
+            && agg_state.is_active()) {
+            agg_state.on_trade(delta.qty);
+        }
+        
+        // For trades, extract LTP/LTQ
+        if (delta.tick_type == 'T') {
+            rec.ltp = delta.price;
+            rec.ltq = delta.qty;
+        }
+    }
+    
+    void on_update(bool is_ask, uint8_t idx, int64_t qty_delta, int32_t count_delta) {
+        OutputLevel* book = is_ask ? rec.asks : rec.bids;
+        
+        // Track affected_lvl: use minimum (topmost) index among all updates
+        affected_lvl[is_ask] = std::min(affected_lvl[is_ask], idx);
+        
+        // Zero-delta markers from trade() and the modify-cross path can land on an empty
+        // slot; there is nothing to delete there, so the book and filled count stay put
+        if (book[idx].price == 0) return;
+        
+        if (book[idx].qty + qty_delta <= 0) {
+            analytics.on_level_remove(is_ask, idx, book);
+        } else {
+            analytics.on_level_change(is_ask, idx, book[idx].price, qty_delta, count_delta);
+        }
+        
+        // Apply update
+        book[idx].qty += qty_delta;
+        book[idx].num_orders += count_delta;
+        
+        // Handle implicit deletion
+        if (book[idx].qty <= 0) {
+            memmove(&book[idx], &book[idx+1], (19-idx) * sizeof(OutputLevel));
+            memset(&book[19], 0, sizeof(OutputLevel));
+            changed[is_ask] |= BookView::kAllLevels << idx;
+            filled(is_ask)--;
+        } else {
+            changed[is_ask] |= 1u << idx;
+        }
+    }
+    
+    void on_insert(bool is_ask, uint8_t idx, bool shift, Price price, int64_t qty, int32_t count) {
+        OutputLevel* book = is_ask ? rec.asks : rec.bids;
+
+        // Track affected_lvl: skip refills (shift=false), use minimum (topmost) non-refill delta
+        if (shift) {  // shift=true → real insertion, not refill
+            affected_lvl[is_ask] = std::min(affected_lvl[is_ask], idx);
+        }
+        
+        analytics.on_level_insert(is_ask, idx, shift, OutputLevel{price, static_cast<int32_t>(qty), count}, book);
+        
+        // Apply insert
+        if (shift) {
+            // Shift levels down before inserting
+            memmove(&book[idx+1], &book[idx], (19-idx) * sizeof(OutputLevel));
+            changed[is_ask] |= BookView::kAllLevels << idx;
+            if (filled(is_ask) < 20) filled(is_ask)++;  // At 20 the last level drops off
+        } else {
+            changed[is_ask] |= 1u << idx;
+            if (book[idx].price == 0) filled(is_ask)++;  // Refill into the freed tail
+        }
+        
+        book[idx].price = price;
+        book[idx].qty = qty;
+        book[idx].num_orders = count;
+    }
+    
+    void on_crossing_complete() {
+        // Crossing has fully resolved - synthesize N/M/X tick for the aggressor
+        // Skip synthesis if current tick is 'C' (self-trade) - 'C' expansion handles it
+        bool is_self_trade = (rec.event.tick_type == 'C');
+        if (agg_state.is_active() && !is_self_trade) {
+            // Check if we need to synthesize a tick
+            bool need_residual = (agg_state.aggressor_remaining > 0);
+            bool need_cancel = (!need_residual && agg_state.original_tick_type == 'B');
+            
+            if (need_residual || need_cancel) {
+                // Emit current record (typically a T/D/E tick) first
+                finalize_record();
+                emit_record();
+                
+                // Synthesize the residual/cancel tick
+                // Keep affected levels from T tick (same logical event)
+                // Note: affected_lvl is NOT reset - N/M/X inherits from T
+                
+                if (need_residual) {
+                    // Aggressor has residual - emit N (from 'A') or M (from 'B')
+                    rec.event.tick_type = (agg_state.original_tick_type == 'A') ? 'N' : 'M';
+                    rec.event.is_ask = agg_state.aggressor_is_ask;
+                    rec.event.price = agg_state.aggressor_price;
+                    rec.event.qty = agg_state.aggressor_remaining;
+                    rec.event.order_id = agg_state.aggressor_id;
+                    rec.event.order_id2 = 0;
+                    rec.is_ask = agg_state.aggressor_is_ask;
+                } else {
+                    // Fully consumed from MODIFY - emit X (order removed from book)
+                    rec.event.tick_type = 'X';
+                    rec.event.is_ask = agg_state.aggressor_is_ask;
+                    rec.event.price = agg_state.aggressor_price;
+                    rec.event.qty = agg_state.aggressor_original_qty;
+                    rec.event.order_id = agg_state.aggressor_id;
+                    rec.event.order_id2 = 0;
+                    rec.is_ask = agg_state.aggressor_is_ask;
+                }
+            }
+            // For 'A' that fully consumed - no additional tick needed, rec stays as T/D/E
+        }
+        if (!is_self_trade) {
+            agg_state.clear();
+        } else {
+            // Self-trade: agg_state remains active for 'C' expansion at end,
+            // but flag that crossing is complete so expansion can clear it
+            agg_state.crossing_complete = true;
+        }
+    }
+    
+    void on_sweep(bool is_ask, uint8_t levels, const OutputLevel* refills, uint8_t num_refills) {
+        OutputLevel* book = is_ask ? rec.asks : rec.bids;
+        
+        // Sweep always starts at the touch
+        affected_lvl[is_ask] = 0;
+        
+        // One memmove for all removed levels, refills straight into the freed tail
+        memmove(&book[0], &book[levels], (20 - levels) * sizeof(OutputLevel));
+        memcpy(&book[20 - levels], refills, num_refills * sizeof(OutputLevel));
+        memset(&book[20 - levels + num_refills], 0, (levels - num_refills) * sizeof(OutputLevel));
+        changed[is_ask] = BookView::kAllLevels;
+        filled(is_ask) = static_cast<int8_t>(std::max(filled(is_ask) - levels, 0) + num_refills);
+        analytics.rebuild(is_ask, book);
+    }
+    
+    // Snapshots decode straight into the book; on_snapshot then only copies foreign spans
+    OutputLevel* snapshot_levels(bool is_ask) { return is_ask ? rec.asks : rec.bids; }
+    
+    void on_snapshot(uint32_t record_idx, std::span<const OutputLevel> bids, std::span<const OutputLevel> asks) {
+        rec.record_idx = record_idx;
+        if (bids.data() != rec.bids) {
+            memcpy(rec.bids, bids.data(), bids.size_bytes());
+            memset(&rec.bids[bids.size()], 0, (20 - bids.size()) * sizeof(OutputLevel));
+        }
+        if (asks.data() != rec.asks) {
+            memcpy(rec.asks, asks.data(), asks.size_bytes());
+            memset(&rec.asks[asks.size()], 0, (20 - asks.size()) * sizeof(OutputLevel));
+        }
+        changed[0] = changed[1] = BookView::kAllLevels;
+        rec.bid_filled_lvls = static_cast<int8_t>(bids.size());
+        rec.ask_filled_lvls = static_cast<int8_t>(asks.size());
+        analytics.rebuild(false, rec.bids);
+        analytics.rebuild(true, rec.asks);
+    }
+    
+    // Finalize the last record and run C expansion.
+    // Returns the number of OutputRecords produced (usually 1, but 3 for 'C' tick; 0 for snapshot)
+    int finish() {
+        finalize_record();
+        
+        // Snapshot-only sequence: book replaced, no event to deliver
+        if (!seen_tick_info) return 0;
+        
+        // Handle 'C' tick expansion: generate S and N ticks using tracked aggressor state.
+        // C, S and N share the book, so each is staged in rec and emitted before the next
+        // overwrites its metadata.
+        if (rec.event.tick_type == 'C' && agg_state.is_active()) {
+            bool aggressor_side = agg_state.aggressor_is_ask;
+        
+            // Distinguish aggressor cancel vs passive cancel:
+            // - Aggressor cancel: cancelled order IS the aggressor (id matches)
+            // - Passive cancel: cancelled order is on the passive side (id doesn't match)
+            bool is_aggressor_cancel = (static_cast<OrderId>(rec.event.order_id) == agg_state.aggressor_id);
+        
+            if (is_aggressor_cancel) {
+                // Aggressor self-trade cancel: exchange cancelled the aggressor
+                // Emit C + S only (no N/B residual since aggressor is gone)
+            
+                // C tick: aggressor's side
+                rec.event.is_ask = aggressor_side;
+                rec.is_ask = aggressor_side;
+                rec.bid_affected_lvl = 0;
+                rec.ask_affected_lvl = 0;
+                emit_record();
+            
+                // S tick: aggressor's side (the cancelled order IS the aggressor)
+                rec.event.tick_type = 'S';
+                rec.bid_affected_lvl = 20;
+                rec.ask_affected_lvl = 20;
+                if (self_trade_cancel_full_qty > 0) {
+                    rec.event.price = self_trade_cancel_price;
+                    rec.event.qty = self_trade_cancel_full_qty;
+                }
+                emit_record();
+            
+                agg_state.clear();
+                return num_records;  // C + S
+            } else {
+                // Passive self-trade cancel: cancelled order was on passive side
+                bool cancelled_side = !aggressor_side;
+            
+                // Fix the 'C' record to use aggressor's side
+                rec.event.is_ask = aggressor_side;
+                rec.is_ask = aggressor_side;
+            
+                // Self-trade cancels inherently affect top of book on both sides:
+                // the cancelled passive order was at/near best price (it was being crossed),
+                // and the aggressor rests on the other side. The speculative crossing already
+                // removed the passive level (no Update deltas in the chunk), so we set
+                // affected levels explicitly rather than relying on delta-derived values.
+                rec.bid_affected_lvl = 0;
+                rec.ask_affected_lvl = 0;
+                emit_record();
+            
+                // 'S' tick: cancelled order's perspective (cancelled order's side)
+                // Synthetic notification: no additional book changes, both affected levels = 20
+                // Price/qty from MBO's explicit S tick (passive order's actual info, not C's VWAP)
+                rec.event.tick_type = 'S';
+                rec.event.is_ask = cancelled_side;
+                rec.is_ask = cancelled_side;
+                rec.bid_affected_lvl = 20;
+                rec.ask_affected_lvl = 20;
+                if (self_trade_cancel_full_qty > 0) {
+                    rec.event.price = self_trade_cancel_price;
+                    rec.event.qty = self_trade_cancel_full_qty;
+                }
+                emit_record();
+            
+                // Tick type depends on whether crossing has been fully confirmed:
+                // - crossing_complete=false: still speculative, use original tick type ('A'/'B')
+                // - crossing_complete=true: confirmed, use residual type ('N'/'M')
+                rec.event.tick_type = agg_state.crossing_complete
+                    ? ((agg_state.original_tick_type == 'A') ? 'N' : 'M')
+                    : agg_state.original_tick_type;
+                rec.event.is_ask = aggressor_side;
+                rec.event.price = agg_state.aggressor_price;
+                rec.event.qty = agg_state.aggressor_remaining;
+                rec.event.order_id = agg_state.aggressor_id;
+                rec.event.order_id2 = 0;
+                rec.is_ask = aggressor_side;
+                // Aggressor side: affected level 0 as on the 'C' record (where add_liquidity happened)
+                // Other side: 20 (not affected)
+                rec.bid_affected_lvl = aggressor_side ? 20 : 0;
+                rec.ask_affected_lvl = aggressor_side ? 0 : 20;
+                emit_record();
+            
+                // Clear agg_state if crossing completed during this self-trade cancel
+                if (agg_state.crossing_complete) {
+                    agg_state.clear();
+                }
+                // else: crossing continues, agg_state stays active for more trades
+                return num_records;  // C + S + N
+            }
+        }
+    
+        emit_record();
+        return num_records;
+    }
+
+private:
+    int8_t& filled(bool is_ask) { return is_ask ? rec.ask_filled_lvls : rec.bid_filled_lvls; }
+    
+    // Stamp the staged record with this record's affected levels (filled counts are live)
+    void finalize_record() {
+        rec.bid_affected_lvl = affected_lvl[0];
+        rec.ask_affected_lvl = affected_lvl[1];
+    }
+    
+    void emit_record() {
+        emit(BookView{&rec, &analytics, changed[0] & BookView::kAllLevels, changed[1] & BookView::kAllLevels});
+        changed[0] = changed[1] = 0;
+        ++num_records;
+    }
+    
+    OutputRecord& rec;
+    BookAnalytics& analytics;
+    PendingAggressorState& agg_state;
+    uint32_t (&changed)[2];  // [bid, ask] levels touched since the last emitted record
+    Sink& emit;
+    int num_records = 0;
+    // Track first delta index on each side for affected_lvl reconstruction
+    uint8_t affected_lvl[2] = {20, 20};  // [bid, ask], 20 = not affected
+    bool seen_tick_info = false;  // Track if we've processed a TickInfoDelta
+    Qty self_trade_cancel_full_qty = 0;   // Full order qty from explicit S tick (for C expansion)
+    Price self_trade_cancel_price = 0;    // Passive order's actual price from explicit S tick
+};
+
+// Reconstruct OutputRecords for one event's chunks and emit a BookView for each
+// (see OutputRecordBuilder for emit order).
+// Returns the number of OutputRecords produced (usually 1, but 3 for 'C' tick; 0 for snapshot)
+template<typename ChunkT, typename Sink>
+int apply_deltas_to_book(ReceiverState& state, std::span<const ChunkT> chunks, Sink&& emit) {
+    PerfProfile("apply_deltas_to_book");
+    state.book.token = chunks[0].token;
+    OutputRecordBuilder<std::remove_reference_t<Sink>> builder(state, emit);
+    apply_deltas(chunks, builder);
+    return builder.finish();
+}
+
+// --- Columnar Receiver Book ---
+// Strategy-side book for apply_deltas with price/qty/count in separate 32-byte aligned
+// columns. A shifting Insert or a deleting Update rewrites a whole side as a fixed run of
+// aligned loads, one-lane-offset loads and blends (5 vectors for prices, 3 each for
+// qty/count) instead of a memmove over packed OutputLevels; zeroed guard lanes around
+// the 20 levels absorb the offset loads, so there is no length or index branch.
+// OutputLevels are only produced on demand (to_output_levels).
+class ColumnarBook {
+public:
+    void on_update(bool is_ask, uint8_t idx, int64_t qty_delta, int32_t count_delta) {
+        Side& side = sides_[is_ask];
+        if (side.price[kPriceFirst + idx] == 0) return;  // Marker update on an empty slot
+        int32_t qty = side.qty[kQtyFirst + idx] += static_cast<int32_t>(qty_delta);
+        side.count[kQtyFirst + idx] += count_delta;
+        if (qty <= 0) {
+            side.shift<+1>(idx);  // Levels below move up, level 19 takes the zero guard
+            side.filled--;
+        }
+    }
+    
+    void on_insert(bool is_ask, uint8_t idx, bool shift, Price price, int64_t qty, int32_t count) {
+        Side& side = sides_[is_ask];
+        if (shift) {
+            side.shift<-1>(idx + 1);  // Level 19 drops off
+            if (side.filled < 20) side.filled++;
+        } else if (side.price[kPriceFirst + idx] == 0) {
+            side.filled++;
+        }
+        side.price[kPriceFirst + idx] = price;
+        side.qty[kQtyFirst + idx] = static_cast<int32_t>(qty);
+        side.count[kQtyFirst + idx] = count;
+    }
+    
+    void on_sweep(bool is_ask, uint8_t levels, const OutputLevel* refills, uint8_t num_refills) {
+        Side& side = sides_[is_ask];
+        side.remove_top(levels);
+        for (int i = 0; i < num_refills; ++i) side.set(20 - levels + i, refills[i]);
+        side.filled = static_cast<int8_t>(std::max(side.filled - levels, 0) + num_refills);
+    }
+    
+    void on_snapshot(uint32_t /*record_idx*/, std::span<const OutputLevel> bids, std::span<const OutputLevel> asks) {
+        sides_[0].load(bids);
+        sides_[1].load(asks);
+    }
+    
+    int8_t filled_levels(bool is_ask) const { return sides_[is_ask].filled; }
+    
+    // Materialize the levels selected by mask (bit i = level i) into OutputLevel arrays
+    void to_output_levels(OutputLevel* bids, OutputLevel* asks,
+                          uint32_t bid_mask = (1u << 20) - 1, uint32_t ask_mask = (1u << 20) - 1) const {
+        sides_[0].store(bids, bid_mask);
+        sides_[1].store(asks, ask_mask);
+    }
+
+private:
+    // Column layout: level i of a price column is lane kPriceFirst + i; the guard lanes on
+    // either side stay zero. qty/count vectors cover levels 0..23, so lanes 20..23 are
+    // padding inside the last vector and are masked out of every blend.
+    static constexpr int kPriceFirst = 4;
+    static constexpr int kQtyFirst = 8;
+    
+    struct Side {
+        alignas(32) int64_t price[kPriceFirst + 20 + 4] = {};
+        alignas(32) int32_t qty[kQtyFirst + 24 + 8] = {};
+        alignas(32) int32_t count[kQtyFirst + 24 + 8] = {};
+        int8_t filled = 0;
+        
+        // Levels [first, 20) take the level at i + Off (Off = -1: shift down, opening
+        // first - 1; Off = +1: shift up, closing first). All loads precede all stores.
+        template<int Off>
+        void shift(int first) {
+            const __m256i from64 = _mm256_set1_epi64x(first - 1);
+            __m256i p[5];
+            for (int k = 0; k < 5; ++k) {
+                __m256i lane = _mm256_add_epi64(_mm256_setr_epi64x(0, 1, 2, 3), _mm256_set1_epi64x(4 * k));
+                __m256i take = _mm256_cmpgt_epi64(lane, from64);
+                p[k] = _mm256_blendv_epi8(vload(&price[kPriceFirst + 4 * k]),
+                                          vloadu(&price[kPriceFirst + 4 * k + Off]), take);
+            }
+            
+            const __m256i from32 = _mm256_set1_epi32(first - 1);
+            const __m256i end32 = _mm256_set1_epi32(20);
+            __m256i q[3], c[3];
+            for (int k = 0; k < 3; ++k) {
+                __m256i lane = _mm256_add_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(8 * k));
+                __m256i take = _mm256_and_si256(_mm256_cmpgt_epi32(lane, from32), _mm256_cmpgt_epi32(end32, lane));
+                q[k] = _mm256_blendv_epi8(vload(&qty[kQtyFirst + 8 * k]), vloadu(&qty[kQtyFirst + 8 * k + Off]), take);
+                c[k] = _mm256_blendv_epi8(vload(&count[kQtyFirst + 8 * k]), vloadu(&count[kQtyFirst + 8 * k + Off]), take);
+            }
+            
+            for (int k = 0; k < 5; ++k) vstore(&price[kPriceFirst + 4 * k], p[k]);
+            for (int k = 0; k < 3; ++k) {
+                vstore(&qty[kQtyFirst + 8 * k], q[k]);
+                vstore(&count[kQtyFirst + 8 * k], c[k]);
+            }
+        }
+        
+        // Sweep: drop the top levels and zero the freed tail (rare, so plain memmove)
+        void remove_top(int levels) {
+            memmove(&price[kPriceFirst], &price[kPriceFirst + levels], (20 - levels) * sizeof(int64_t));
+            memmove(&qty[kQtyFirst], &qty[kQtyFirst + levels], (20 - levels) * sizeof(int32_t));
+            memmove(&count[kQtyFirst], &count[kQtyFirst + levels], (20 - levels) * sizeof(int32_t));
+            memset(&price[kPriceFirst + 20 - levels], 0, levels * sizeof(int64_t));
+            memset(&qty[kQtyFirst + 20 - levels], 0, levels * sizeof(int32_t));
+            memset(&count[kQtyFirst + 20 - levels], 0, levels * sizeof(int32_t));
+        }
+        
+        void set(int i, const OutputLevel& level) {
+            price[kPriceFirst + i] = level.price;
+            qty[kQtyFirst + i] = level.qty;
+            count[kQtyFirst + i] = level.num_orders;
+        }
+        
+        void load(std::span<const OutputLevel> levels) {
+            for (int i = 0; i < 20; ++i) {
+                set(i, i < static_cast<int>(levels.size()) ? levels[i] : OutputLevel{});
+            }
+            filled = static_cast<int8_t>(levels.size());
+        }
+        
+        void store(OutputLevel* out, uint32_t mask) const {
+            for (; mask; mask &= mask - 1) {
+                int i = __builtin_ctz(mask);
+                out[i] = OutputLevel{price[kPriceFirst + i], qty[kQtyFirst + i], count[kQtyFirst + i]};
+            }
+        }
+        
+        static __m256i vload(const void* p) { return _mm256_load_si256(static_cast<const __m256i*>(p)); }
+        static __m256i vloadu(const void* p) { return _mm256_loadu_si256(static_cast<const __m256i*>(p)); }
+        static void vstore(void* p, __m256i v) { _mm256_store_si256(static_cast<__m256i*>(p), v); }
+    };
+    
+    Side sides_[2];  // [bid, ask]
+};
+
+// --- Book History ---
+// Per-token lookback for signals that compare against an earlier book. Rather than a
+// 640-byte copy per event, the ring keeps each applied event's raw delta chunks plus a
+// keyframe (both sides' levels) every kKeyframeInterval events; a query copies the nearest
+// keyframe at or before the requested event and replays the events after it through a
+// ColumnarBook. All storage is sized at construction, so memory per token is fixed:
+// about 2 chunks per event of depth plus one 650-byte keyframe per interval.
+struct HistoricalBook {
+    uint32_t record_idx;     // Last record applied
+    int8_t bid_filled_lvls;
+    int8_t ask_filled_lvls;
+    OutputLevel bids[20];
+    OutputLevel asks[20];
+};
+
+class BookHistory {
+public:
+    static constexpr size_t kKeyframeInterval = 32;
+    
+    // depth is a best-effort bound: the last `depth` events can be queried while their
+    // chunks average at most two per event. Runs of larger events evict the oldest early,
+    // counted in book_history_evicted. The event ring carries one extra interval so the
+    // keyframe preceding the oldest queryable event is always replayable.
+    // arena (nullptr = heap) holds the rings, like the books they shadow
+    BookHistory(size_t depth, HugePageArena* arena)
+        : entries_(depth + kKeyframeInterval, ArenaAllocator<Entry>(arena)),
+          chunks_(std::max(2 * entries_.size(), 2 * kMaxEventChunks), ArenaAllocator<DeltaChunk>(arena)),
+          keyframes_(entries_.size() / kKeyframeInterval + 2, ArenaAllocator<Keyframe>(arena)) {}
+    
+    // Forget all events, keeping the preallocated rings
+    void clear() {
+        next_seq_ = oldest_seq_ = chunk_head_ = 0;
+        for (Keyframe& kf : keyframes_) kf.seq = UINT64_MAX;
+    }
+    
+    // Append one applied event; book is the receiver's book after applying it
+    void record(std::span<const DeltaChunk> chunks, const OutputRecord& book) {
+        always_assert(chunks.size() <= kMaxEventChunks);
+        if (next_seq_ - oldest_seq_ == entries_.size()) ++oldest_seq_;
+        
+        // Chunk positions are virtual (ever-increasing); an event that would straddle the
+        // end of the ring starts at the next lap instead, so each event stays contiguous
+        uint64_t first = chunk_head_;
+        if (first % chunks_.size() + chunks.size() > chunks_.size()) first += chunks_.size() - first % chunks_.size();
+        uint64_t end = first + chunks.size();
+        uint64_t evicted = 0;
+        while (oldest_seq_ < next_seq_ && entry(oldest_seq_).first_chunk + chunks_.size() < end) {
+            ++oldest_seq_;  // Overwritten by this event (chunk pressure from multi-chunk events)
+            ++evicted;
+        }
+        if (evicted) [[unlikely]] PerfProfileCount("book_history_evicted", evicted);
+        std::copy(chunks.begin(), chunks.end(), chunks_.begin() + first % chunks_.size());
+        chunk_head_ = end;
+        
+        Entry& e = entry(next_seq_);
+        e.record_idx = book.record_idx;
+        e.first_chunk = first;
+        e.num_chunks = static_cast<uint16_t>(chunks.size());
+        
+        if (next_seq_ % kKeyframeInterval == 0) {
+            // Replay takes the keyframe's filled counts as span lengths
+            always_assert(book.bid_filled_lvls >= 0 && book.bid_filled_lvls <= 20 &&
+                          book.ask_filled_lvls >= 0 && book.ask_filled_lvls <= 20);
+            Keyframe& kf = keyframes_[(next_seq_ / kKeyframeInterval) % keyframes_.size()];
+            kf.seq = next_seq_;
+            kf.book.record_idx = book.record_idx;
+            kf.book.bid_filled_lvls = book.bid_filled_lvls;
+            kf.book.ask_filled_lvls = book.ask_filled_lvls;
+            memcpy(kf.book.bids, book.bids, sizeof(book.bids));
+            memcpy(kf.book.asks, book.asks, sizeof(book.asks));
+        }
+        ++next_seq_;
+    }
+    
+    // Book after the event events_ago before the latest (0 = latest); false if not retained
+    bool book_at(size_t events_ago, HistoricalBook& out) const {
+        if (events_ago >= next_seq_ - oldest_seq_) return false;
+        return book_at_seq(next_seq_ - 1 - events_ago, out);
+    }
+    
+    // Book after the last event with record_idx <= record_idx; false if that event isn't retained
+    bool book_at_record(uint32_t record_idx, HistoricalBook& out) const {
+        if (oldest_seq_ == next_seq_ || entry(oldest_seq_).record_idx > record_idx) return false;
+        uint64_t lo = oldest_seq_, hi = next_seq_ - 1;  // record_idx is non-decreasing per token
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo + 1) / 2;
+            if (entry(mid).record_idx <= record_idx) lo = mid; else hi = mid - 1;
+        }
+        return book_at_seq(lo, out);
+    }
+
+private:
+    static constexpr size_t kMaxEventChunks = 20;  // Matches the emitter's chunk limit
+    
+    struct Entry {
+        uint32_t record_idx = 0;
+        uint16_t num_chunks = 0;
+        uint64_t first_chunk = 0;  // Virtual position, chunks_ index is first_chunk % size
+    };
+    struct Keyframe {
+        uint64_t seq = UINT64_MAX;
+        HistoricalBook book{};
+    };
+    
+    Entry& entry(uint64_t seq) { return entries_[seq % entries_.size()]; }
+    const Entry& entry(uint64_t seq) const { return entries_[seq % entries_.size()]; }
+    
+    bool book_at_seq(uint64_t seq, HistoricalBook& out) const {
+        uint64_t kseq = seq - seq % kKeyframeInterval;
+        const Keyframe& kf = keyframes_[(kseq / kKeyframeInterval) % keyframes_.size()];
+        if (kf.seq != kseq || kseq + 1 < oldest_seq_) return false;
+        
+        PerfProfile("book_history_replay");
+        ColumnarBook replay;
+        replay.on_snapshot(kf.book.record_idx, std::span<const OutputLevel>(kf.book.bids, kf.book.bid_filled_lvls),
+                           std::span<const OutputLevel>(kf.book.asks, kf.book.ask_filled_lvls));
+        for (uint64_t s = kseq + 1; s <= seq; ++s) {
+            const Entry& e = entry(s);
+            apply_deltas(std::span<const DeltaChunk>(&chunks_[e.first_chunk % chunks_.size()], e.num_chunks), replay);
+        }
+        out.record_idx = entry(seq).record_idx;
+        out.bid_filled_lvls = replay.filled_levels(false);
+        out.ask_filled_lvls = replay.filled_levels(true);
+        replay.to_output_levels(out.bids, out.asks);
+        return true;
+    }
+    
+    std::vector<Entry, ArenaAllocator<Entry>> entries_;           // Ring indexed by seq % size
+    std::vector<DeltaChunk, ArenaAllocator<DeltaChunk>> chunks_;  // Event chunk storage, each event contiguous
+    std::vector<Keyframe, ArenaAllocator<Keyframe>> keyframes_;   // Ring indexed by (seq / kKeyframeInterval) % size
+    uint64_t next_seq_ = 0;
+    uint64_t oldest_seq_ = 0;         // Oldest event whose chunks are still stored
+    uint64_t chunk_head_ = 0;         // Virtual position of the next free chunk
+};
+
+inline void BookHistoryDeleter::operator()(BookHistory* history) const {
+    history->~BookHistory();
+    ArenaAllocator<BookHistory>(arena).deallocate(history, 1);
+}
+
+inline BookHistoryPtr make_book_history(size_t depth, HugePageArena* arena) {
+    BookHistory* history = ArenaAllocator<BookHistory>(arena).allocate(1);
+    return BookHistoryPtr(new (history) BookHistory(depth, arena), BookHistoryDeleter{arena});
+}
+
+// --- Book Observer (strategy callback interface) ---
+// In production: strategy process receives book views via this interface. Runner
+// dispatches statically to any type providing
+//   bool on_book_view(const BookView& view)          - per delivered record; false aborts
+//   bool on_conflation(Token, uint32_t events_folded) - optional, see below
+// on_conflation is called right before a conflated view: the consumer fell behind and
+// events_folded queued events for this token were applied without delivery. The view
+// carries the latest event's metadata, the current book, the topmost affected level and
+// the union of changed levels across all folded events.
+template<typename T>
+concept BookViewObserver = requires(T& observer, const BookView& view) {
+    { observer.on_book_view(view) } -> std::convertible_to<bool>;
+};
+
+// Runtime-polymorphic adapter for strategies that can only be reached through a
+// vtable; costs one virtual call per record on top of the static path.
+class BookObserver {
+public:
     virtual ~BookObserver() = default;
-    // Called for each book snapshot produced by delta application.
-    // Return true to continue processing, false to abort.
     virtual bool on_book_update(const OutputRecord& book) = 0;
+    virtual bool on_conflation(Token /*token*/, uint32_t /*events_folded*/) { return true; }
+    bool on_book_view(const BookView& view) { return on_book_update(*view.book); }
+};
+
+// Owned copy of a BookView, for delivering after the receiver has moved on
+struct ViewCopy {
+    uint32_t bid_changed;
+    uint32_t ask_changed;
+    OutputRecord book;
+    BookAnalytics analytics;
+    
+    void assign(const BookView& view) {
+        bid_changed = view.bid_changed;
+        ask_changed = view.ask_changed;
+        book = *view.book;
+        analytics = *view.analytics;
+    }
+    BookView view() const { return BookView{&book, &analytics, bid_changed, ask_changed}; }
+};
+
+// Buffers views produced out of input order (batched processing) and replays them to the
+// wrapped observer in input order; views of one input keep their delivery order.
+template<BookViewObserver Observer>
+class OrderRestorer {
+public:
+    explicit OrderRestorer(Observer& observer) : observer_(observer) {}
+    
+    // Input position (within the current batch) of the views that follow
+    void set_position(uint32_t position) { position_ = position; }
+    
+    bool on_book_view(const BookView& view) {
+        if (count_ == views_.size()) views_.emplace_back();
+        views_[count_].assign(view);
+        order_.emplace_back(position_, count_++);
+        return true;
+    }
+    
+    // Deliver buffered views in input order; first_input is the batch's first input index
+    bool release(size_t first_input) {
+        PerfProfile("order_restore");
+        std::stable_sort(order_.begin(), order_.end(),
+                         [](const auto& a, const auto& b) { return a.first < b.first; });
+        bool ok = true;
+        for (const auto& [position, slot] : order_) {
+            if constexpr (requires { observer_.set_current_input(first_input); }) {
+                observer_.set_current_input(first_input + position);
+            }
+            if (!(ok = observer_.on_book_view(views_[slot].view()))) break;
+        }
+        order_.clear();
+        count_ = 0;
+        return ok;
+    }
+
+private:
+    Observer& observer_;
+    uint32_t position_ = 0;
+    std::vector<ViewCopy> views_;  // Reused across batches
+    std::vector<std::pair<uint32_t, uint32_t>> order_;  // (position, views_ slot)
+    uint32_t count_ = 0;
+};
+
+// --- Token Directory ---
+// Dense per-instrument store keyed by token. Tokens are 3-byte exchange ids from the
+// contract master, so a two-level table (4096 pages of 4096 slots, pages allocated on
+// first use) maps a token straight to its object: no hashing, no probing, and the page
+// for an active token range stays cached. Objects are constructed in place in
+// fixed-size arena blocks and never move, so references stay valid.
+template<typename T>
+class TokenDirectory {
+public:
+    static constexpr uint32_t kTokenBits = 24;
+    
+    // arena (nullptr = heap) holds the object blocks
+    explicit TokenDirectory(HugePageArena* arena = nullptr) : arena_(arena) {}
+    TokenDirectory(const TokenDirectory&) = delete;
+    TokenDirectory& operator=(const TokenDirectory&) = delete;
+    
+    ~TokenDirectory() {
+        for_each([](Token, T& obj) { obj.~T(); });  // Freed slots were destroyed by take()
+        for (Block* block : blocks_) ArenaAllocator<Block>(arena_).deallocate(block, 1);
+    }
+    
+    T* find(Token token) const {
+        if (token >> kTokenBits) [[unlikely]] return nullptr;
+        const Page* page = pages_[token >> kPageBits].get();
+        return page ? page->slots[token & kPageMask] : nullptr;
+    }
+    
+    // Existing object for token, or one constructed in place from args
+    template<typename... Args>
+    T& get_or_create(Token token, Args&&... args) {
+        if (T* found = find(token)) [[likely]] return *found;
+        always_assert(!(token >> kTokenBits) && "tokens are 3-byte exchange ids");
+        
+        auto& page = pages_[token >> kPageBits];
+        if (!page) page = make_unique<Page>();
+        T* obj;
+        if (!free_.empty()) {
+            // Reuse a slot a migrated-out token left behind
+            size_t index = free_.back();
+            free_.pop_back();
+            obj = new (slot(index)) T(std::forward<Args>(args)...);
+            tokens_[index] = token;
+        } else {
+            if (size_ == blocks_.size() * kBlockObjects) blocks_.push_back(ArenaAllocator<Block>(arena_).allocate(1));
+            obj = new (slot(size_)) T(std::forward<Args>(args)...);
+            ++size_;
+            tokens_.push_back(token);
+        }
+        page->slots[token & kPageMask] = obj;
+        return *obj;
+    }
+    
+    // Pull token's page slot into cache ahead of find()
+    void prefetch(Token token) const {
+        if (token >> kTokenBits) [[unlikely]] return;
+        if (const Page* page = pages_[token >> kPageBits].get()) __builtin_prefetch(&page->slots[token & kPageMask]);
+    }
+    
+    // Move token's object into out and unlink it; false if the token is unknown. The
+    // moved-from object is destroyed and its slot goes back on a free list for the next
+    // get_or_create, so migrations don't grow the directory.
+    bool take(Token token, std::optional<T>& out) {
+        T* obj = find(token);
+        if (!obj) return false;
+        out.emplace(std::move(*obj));
+        obj->~T();
+        pages_[token >> kPageBits]->slots[token & kPageMask] = nullptr;
+        free_.push_back(index_of(obj));
+        return true;
+    }
+    
+    // Visit live (token, object) pairs in slot order
+    template<typename F>
+    void for_each(F&& f) const {
+        for (size_t i = 0; i < size_; ++i) {
+            if (find(tokens_[i]) == slot(i)) f(tokens_[i], *slot(i));
+        }
+    }
+
+private:
+    static constexpr uint32_t kPageBits = 12;
+    static constexpr uint32_t kPageMask = (1u << kPageBits) - 1;
+    static constexpr size_t kBlockObjects = 64;
+    
+    struct Page {
+        T* slots[1u << kPageBits] = {};
+    };
+    struct Block {
+        alignas(T) unsigned char storage[kBlockObjects * sizeof(T)];
+    };
+    
+    T* slot(size_t i) const {
+        return reinterpret_cast<T*>(blocks_[i / kBlockObjects]->storage) + i % kBlockObjects;
+    }
+    
+    // Blocks aren't contiguous, so a slot's index is found through its owning block
+    size_t index_of(const T* obj) const {
+        for (size_t b = 0; b < blocks_.size(); ++b) {
+            const T* first = reinterpret_cast<const T*>(blocks_[b]->storage);
+            if (obj >= first && obj < first + kBlockObjects) return b * kBlockObjects + (obj - first);
+        }
+        always_assert(false && "object not in this directory");
+        return 0;
+    }
+    
+    std::unique_ptr<Page> pages_[1u << (kTokenBits - kPageBits)];
+    HugePageArena* arena_;
+    std::vector<Block*> blocks_;  // Objects in creation order
+    std::vector<Token> tokens_;     // Token of each slot; stale for freed slots
+    std::vector<size_t> free_;      // Slots released by take(), reused first
+    size_t size_ = 0;
 };
 
-// --- Runner ---
-// Simulates the publisher→SHM→strategy pipeline in a single process.
-// process_record() = publisher context (MBO operations → deltas to SHM buffer)
-// process_deltas()  = strategy context (deltas → book reconstruction → observer callback)
-class Runner {
-public:
-    Runner() {
-        mbos_.reserve(100);
-        reconstructed_books_.reserve(100);
-        aggressor_states_.reserve(100);
+// --- Hardware Counter ---
+// Per-thread hardware event counter via perf_event_open. Best effort: when the kernel or
+// container doesn't allow it, available() is false and read() returns 0.
+class HwCounter {
+public:
+    // inherit: also count threads created afterwards (added in as they exit)
+    HwCounter(uint32_t type, uint64_t config, bool inherit = false) {
+        perf_event_attr attr{};
+        attr.type = type;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.inherit = inherit;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+    ~HwCounter() {
+        if (fd_ >= 0) close(fd_);
+    }
+    HwCounter(const HwCounter&) = delete;
+    HwCounter& operator=(const HwCounter&) = delete;
+    
+    bool available() const { return fd_ >= 0; }
+    uint64_t read() const {
+        uint64_t value = 0;
+        if (fd_ < 0 || ::read(fd_, &value, sizeof(value)) != sizeof(value)) return 0;
+        return value;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+// --- Interleaved Record Task ---
+// Coroutine for one record under interleaved (AMAC-style) execution: it prefetches the
+// next link of the token → MBO → levels chain and suspends, so the misses of several
+// records overlap instead of serializing. Frames come from a per-thread free list since
+// every task has the same frame size; a heap allocation per record would cost more than
+// the misses it hides.
+class FramePool {
+public:
+    static void* allocate(size_t size) {
+        FramePool& pool = local();
+        if (size == pool.frame_size_ && !pool.free_.empty()) {
+            void* frame = pool.free_.back();
+            pool.free_.pop_back();
+            return frame;
+        }
+        return ::operator new(size);
+    }
+    static void release(void* frame, size_t size) {
+        FramePool& pool = local();
+        if (pool.frame_size_ == 0) pool.frame_size_ = size;
+        if (size == pool.frame_size_) pool.free_.push_back(frame);
+        else ::operator delete(frame);
+    }
+    
+    ~FramePool() {
+        for (void* frame : free_) ::operator delete(frame);
+    }
+
+private:
+    static FramePool& local() {
+        static thread_local FramePool pool;
+        return pool;
+    }
+    
+    std::vector<void*> free_;
+    size_t frame_size_ = 0;
+};
+
+class RecordTask {
+public:
+    struct promise_type {
+        RecordTask get_return_object() { return RecordTask(Handle::from_promise(*this)); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+        
+        static void* operator new(size_t size) { return FramePool::allocate(size); }
+        static void operator delete(void* frame, size_t size) { FramePool::release(frame, size); }
+    };
+    using Handle = std::coroutine_handle<promise_type>;
+    
+    explicit RecordTask(Handle handle) : handle_(handle) {}
+    RecordTask(RecordTask&& other) : handle_(std::exchange(other.handle_, nullptr)) {}
+    RecordTask(const RecordTask&) = delete;
+    ~RecordTask() {
+        if (handle_) handle_.destroy();
+    }
+    
+    // Caller takes over resuming and destroying the coroutine
+    Handle release() { return std::exchange(handle_, nullptr); }
+
+private:
+    Handle handle_;
+};
+
+// Contract-list entry for the pre-session warm-up; zero hints keep the default sizing
+struct ContractSpec {
+    Token token;
+    uint32_t expected_orders = 0;
+    uint32_t expected_levels = 0;
+};
+
+// --- Runner ---
+// Simulates the publisher→SHM→strategy pipeline in a single process.
+// process_record() = publisher context (MBO operations → deltas to SHM buffer)
+// process_deltas()  = strategy context (deltas → book reconstruction → observer callback)
+class Runner {
+public:
+    // arena (nullptr = heap) backs all per-instrument state: MBOs, their levels and order
+    // tables, and receiver books
+    explicit Runner(HugePageArena* arena = g_instrument_arena)
+        : arena_(arena), mbos_(arena), receivers_(arena) {}
+    
+    // Publisher context: process input record, emit deltas to SHM buffer
+    void process_record(const InputRecord& rec);
+    
+    // Pre-session: create, size and pre-fault every listed instrument (publisher and
+    // receiver side), optionally run rounds of synthetic traffic through the whole
+    // pipeline to prime caches and branch predictors, then reset all book state
+    void warm_up(std::span<const ContractSpec> contracts, size_t rounds);
+    
+    // Publisher context: emit a bootstrap snapshot of token's book to SHM buffer.
+    // Returns false (nothing emitted) for unknown tokens or while a cross is pending.
+    bool emit_snapshot(Token token, Price tick_size);
+    
+    // Publisher context: process records stably grouped by token, so each token's MBO is
+    // touched once per batch while per-token order holds. after(i) runs once records[i]
+    // has been processed, in processing order (e.g. to drain and tag its deliveries).
+    template<typename F> void process_batch(std::span<const InputRecord> records, F&& after);
+    void process_batch(std::span<const InputRecord> records) { process_batch(records, [](size_t) {}); }
+    
+    // Publisher context: process records with up to width of them in flight as coroutines
+    // that prefetch and suspend before each dependent miss. Deltas come out exactly as
+    // from process_record() over the same records.
+    void process_interleaved(std::span<const InputRecord> records, size_t width);
+    
+    // Publisher context: publish a partially filled packed chunk (idle / end of input)
+    void flush_deltas();
+    
+    // Publisher context (pipelined): hand published chunks to sink(chunk) in order and drop
+    // them; an open packed chunk stays until it is flushed
+    template<typename Sink> void take_published(Sink&& sink);
+    
+    // Strategy context (pipelined): append one chunk taken from another Runner's publisher.
+    // Chunks become visible to process_deltas() once their event's final chunk arrives.
+    void receive_chunk(const DeltaChunk& chunk) {
+        shm_deltas_.push_back(chunk);
+        if (chunk.flags & ChunkFinal) published_ = shm_deltas_.size();
+    }
+    
+    // Strategy context: apply all published deltas to reconstructed books, deliver
+    // views via observer. Returns false if observer requested abort.
+    template<BookViewObserver Observer> bool process_deltas(Observer& observer);
+    
+    // Strategy context: token's reconstructed book with any deferred (top-only) events
+    // applied first; nullptr for a token that hasn't been seen
+    const OutputRecord* current_book(Token token);
+    
+    // Strategy context (--history N): token's book events_ago events back (0 = current), or
+    // after its last event with record_idx <= record_idx. False if off, unknown or too old.
+    bool book_at(Token token, size_t events_ago, HistoricalBook& out);
+    bool book_at_record(Token token, uint32_t record_idx, HistoricalBook& out);
+    
+    void report_active_orders() const;
+    
+    // Shard migration: a token's publisher and receiver state in transit between Runners
+    struct TokenState {
+        std::optional<MBO> mbo;
+        std::optional<ReceiverState> receiver;
+        std::optional<ColumnarBook> columnar;
+    };
+    
+    // Move token's state out (the token is then unknown here) / install it. Published
+    // deltas must be drained first so none of the token's events is split across Runners.
+    unique_ptr<TokenState> extract_token(Token token);
+    void adopt_token(Token token, unique_ptr<TokenState> state);
+
+    // Two 36-byte TickInfo groups can't share a 64-byte chunk, so packing needs 128B geometry
+    static constexpr bool kPackingUseful =
+        2 * (sizeof(GroupHeader) + sizeof(TickInfoDelta)) <= DeltaChunk::PAYLOAD;
+
+private:
+    // Publisher context (interleaved): one record as a suspendable task
+    RecordTask record_task(const InputRecord& rec);
+    
+    // Pre-session: empty every book and drop pending deltas, keeping all allocations
+    void reset_state();
+    
+    // Publisher context (--cold-after): rehydrate mbo if cold, mark it active, and
+    // periodically compact books that have gone idle
+    void track_residency(MBO& mbo);
+    void sweep_residency();
+    static constexpr size_t kResidencySweepRecords = 4096;  // Records between idle scans
+    
+    // Append one event's chunks to the SHM buffer, packing it into the open chunk if enabled
+    void publish_event(std::span<const DeltaChunk> chunks, size_t tail_bytes);
+    
+    // Strategy context: walk published chunks one complete event at a time
+    template<typename F> bool drain_events(F&& on_event);
+    
+    // Strategy context: apply one event to the token's receiver state and history
+    template<typename Sink> int apply_event(ReceiverState& receiver, std::span<const DeltaChunk> chunks, Sink&& emit);
+    
+    // Strategy context: apply one complete event and deliver its records
+    template<typename Observer> bool deliver_event(std::span<const DeltaChunk> chunks, Observer& observer);
+    
+    // Strategy context (top-only): queue events that leave level 0 alone undecoded and
+    // deliver the rest, applying the token's queue first
+    template<typename Observer> bool deliver_top_event(std::span<const DeltaChunk> chunks, Observer& observer);
+    void apply_deferred(ReceiverState& receiver);
+    static constexpr size_t kMaxDeferredChunks = 64;  // Apply early beyond this (bounds memory)
+    
+    // Strategy context (conflation): apply one event silently / deliver one update per token
+    void fold_event(std::span<const DeltaChunk> chunks);
+    template<typename Observer> bool deliver_conflated(Observer& observer);
+    
+    // Strategy context (--columnar-bench): replay the event into the token's ColumnarBook
+    // and check it against the reconstructed OutputRecord levels and, when the observer
+    // validates against a reference, against the reference record of the event's last view
+    void shadow_columnar(std::span<const DeltaChunk> chunks, const OutputRecord* reference = nullptr);
+    
+    HugePageArena* arena_;
+    
+    // --- Publisher state ---
+    TokenDirectory<MBO> mbos_;
+    DeltaEmitter emitter_;  // Shared by all MBOs, holds the event being built
+    uint64_t residency_now_ns_ = 0;  // Clock sampled at the last residency sweep
+    size_t records_since_sweep_ = 0;
+    // Rehydrations and sweeps run past PerfProfiler's 32000-cycle outlier cut, so they are
+    // timed here: count, total ns and max ns each
+    size_t rehydrations_ = 0;
+    uint64_t rehydrate_ns_ = 0;
+    uint64_t rehydrate_max_ns_ = 0;
+    size_t sweeps_ = 0;
+    uint64_t sweep_ns_ = 0;
+    uint64_t sweep_max_ns_ = 0;
+    std::vector<uint32_t> batch_order_;  // process_batch: record positions, grouped by token
+    std::unique_ptr<HwCounter> cache_misses_;  // process_batch: opened on first use
+    std::vector<RecordTask::Handle> task_slots_;  // process_interleaved: in-flight records
+    
+    // --- SHM simulation (chunks awaiting the strategy) ---
+    // [0, published_) is readable by the strategy; in packing mode the last chunk may be
+    // an open packed chunk still accepting groups (pack_offset_ payload bytes used).
+    std::vector<DeltaChunk> shm_deltas_;
+    size_t published_ = 0;
+    size_t pack_offset_ = 0;
+    bool pack_open_ = false;
+    
+    // --- Strategy/receiver state ---
+    TokenDirectory<ReceiverState> receivers_;
+    boost::unordered::unordered_flat_map<Token, ColumnarBook> columnar_books_;
+    
+    // --history-check: copies of each token's last live books, indexed by event count
+    struct HistoryShadow {
+        std::vector<HistoricalBook> books;
+        uint64_t events = 0;
+    };
+    boost::unordered::unordered_flat_map<Token, HistoryShadow> history_shadows_;
+    void check_history(Token token, const ReceiverState& receiver);
+    
+    // Token's receiver state, created on first use together with its --history ring, so the
+    // delivery path never allocates one
+    ReceiverState& receiver_state(Token token) {
+        if (ReceiverState* found = receivers_.find(token)) [[likely]] return *found;
+        ReceiverState& receiver = receivers_.get_or_create(token);
+        if (g_history_events) receiver.history = make_book_history(g_history_events, arena_);
+        return receiver;
+    }
+    
+    // --- Conflation state (reused across passes) ---
+    struct ConflatedBook {
+        uint64_t last_seq;          // Position of the token's last event in the backlog
+        uint32_t events = 0;
+        int8_t bid_affected_lvl = 20;
+        int8_t ask_affected_lvl = 20;
+        uint32_t bid_changed = 0;
+        uint32_t ask_changed = 0;
+    };
+    boost::unordered::unordered_flat_map<Token, ConflatedBook> conflated_;
+    std::vector<std::pair<uint64_t, Token>> conflated_order_;
+    uint64_t fold_seq_ = 0;
+};
+
+void Runner::process_record(const InputRecord& rec) {
+    PerfProfileCount("records_processed", 1);
+    rec.print();
+
+    Token token = rec.token;
+    MBO& mbo = mbos_.get_or_create(token, token, &emitter_, arena_);
+    if (g_cold_after_ns) track_residency(mbo);
+
+    PerfProfile("got_mbo");
+    
+    mbo.prepare_deltas(token, rec.record_idx);
+    
+    switch (rec.tick_type) {
+        case 'N': {PerfProfile("new_order"); mbo.new_order(rec.order_id, rec.is_ask, rec.price, rec.qty); break;}
+        case 'M': {PerfProfile("modify_order"); mbo.modify_order(rec.order_id, rec.price, rec.qty); break;}
+        case 'X': {PerfProfile("cancel_order"); mbo.cancel_order(rec.order_id); break;}
+        case 'T': {PerfProfile("trade"); mbo.trade(rec.order_id, rec.order_id2, rec.price, rec.qty); break;}
+    }
+    
+    mbo.finalize_deltas();
+
+    // Copy deltas to SHM buffer (simulates publisher writing to shared memory)
+    auto chunks = mbo.get_delta_chunks();
+    publish_event(chunks, mbo.delta_tail_bytes());
+    if (g_chunk_stats) report_chunk_geometry(chunks);
+    
+#ifndef printf
+    for (const auto& chunk : shm_deltas_) {
+        std::cout << "  " << chunk << "\n";
+    }
+#endif
+}
+
+bool Runner::emit_snapshot(Token token, Price tick_size) {
+    MBO* found = mbos_.find(token);
+    if (!found || found->cross_pending()) return false;
+    
+    PerfProfile("emit_snapshot");
+    MBO& mbo = *found;
+    mbo.emit_snapshot(tick_size);
+    auto chunks = mbo.get_delta_chunks();
+    PerfProfileCount("snapshot_chunks", chunks.size());
+    publish_event(chunks, mbo.delta_tail_bytes());
+    return true;
+}
+
+void Runner::publish_event(std::span<const DeltaChunk> chunks, size_t tail_bytes) {
+    size_t group_bytes = sizeof(GroupHeader) + tail_bytes;
+    // Without kPackingUseful a packed chunk would hold a single group: only the header
+    // overhead and the flush latency, so --pack is a no-op at that geometry
+    bool packable = kPackingUseful && g_pack_chunks && chunks.size() == 1 && group_bytes <= DeltaChunk::PAYLOAD;
+    
+    if (!packable) {
+        // Close any open packed chunk first so events stay in publish order
+        shm_deltas_.insert(shm_deltas_.end(), chunks.begin(), chunks.end());
+        pack_open_ = false;
+        published_ = shm_deltas_.size();
+        return;
+    }
+    
+    if (pack_open_ && pack_offset_ + group_bytes > DeltaChunk::PAYLOAD) {
+        flush_deltas();
+    }
+    if (!pack_open_) {
+        shm_deltas_.emplace_back();
+        shm_deltas_.back().flags = ChunkFinal | ChunkPacked;
+        pack_offset_ = 0;
+        pack_open_ = true;
+    }
+    
+    DeltaChunk& packed = shm_deltas_.back();
+    GroupHeader group;
+    group.type = DeltaType::Group;
+    group.num_deltas = chunks[0].num_deltas;
+    group.bytes = static_cast<uint16_t>(tail_bytes);
+    group.token = chunks[0].token;
+    group.summary = chunks[0].summary;
+    memcpy(&packed.payload[pack_offset_], &group, sizeof(group));
+    memcpy(&packed.payload[pack_offset_ + sizeof(group)], chunks[0].payload, tail_bytes);
+    pack_offset_ += group_bytes;
+    packed.num_deltas++;
+}
+
+void Runner::flush_deltas() {
+    if (pack_open_) {
+        PerfProfileCount("packed_events_per_chunk", shm_deltas_.back().num_deltas);
+    }
+    pack_open_ = false;
+    published_ = shm_deltas_.size();
+}
+
+template<typename F>
+void Runner::process_batch(std::span<const InputRecord> records, F&& after) {
+    if (!cache_misses_) cache_misses_ = make_unique<HwCounter>(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    uint64_t start = PerfProfileTsc();
+    uint64_t misses = cache_misses_->read();
+    
+    batch_order_.resize(records.size());
+    for (uint32_t i = 0; i < records.size(); ++i) batch_order_[i] = i;
+    std::stable_sort(batch_order_.begin(), batch_order_.end(),
+                     [&](uint32_t a, uint32_t b) { return records[a].token < records[b].token; });
+    for (uint32_t i : batch_order_) {
+        process_record(records[i]);
+        after(i);
+    }
+    
+    // Per-record figures: compare against --batch-window 1 (input order) for the gain
+    if (records.empty()) return;
+    PerfProfileCount("batch_cycles_per_record", (PerfProfileTsc() - start) / records.size());
+    if (cache_misses_->available()) {
+        PerfProfileCount("batch_cache_misses_per_record", (cache_misses_->read() - misses) / records.size());
+    }
+}
+
+// Every task suspends the same number of times and slots are resumed round-robin, so
+// tasks finish (and run process_record) in the order they started. Prefetch stages only
+// read, so a token appearing twice in flight needs no special handling.
+RecordTask Runner::record_task(const InputRecord& rec) {
+    mbos_.prefetch(rec.token);
+    co_await std::suspend_always{};
+    const MBO* mbo = mbos_.find(rec.token);
+    if (mbo) mbo->prefetch_members();
+    co_await std::suspend_always{};
+    if (mbo) mbo->prefetch_levels();
+    co_await std::suspend_always{};
+    process_record(rec);
+}
+
+void Runner::process_interleaved(std::span<const InputRecord> records, size_t width) {
+    task_slots_.assign(std::max<size_t>(width, 1), nullptr);
+    size_t next = 0, active = 0;
+    while (next < records.size() || active) {
+        for (auto& slot : task_slots_) {
+            if (slot) {
+                slot.resume();
+                if (slot.done()) {
+                    slot.destroy();
+                    slot = nullptr;
+                    --active;
+                }
+            }
+            if (!slot && next < records.size()) {
+                slot = record_task(records[next++]).release();
+                ++active;
+            }
+        }
+    }
+}
+
+template<typename Sink>
+void Runner::take_published(Sink&& sink) {
+    for (size_t i = 0; i < published_; ++i) sink(shm_deltas_[i]);
+    shm_deltas_.erase(shm_deltas_.begin(), shm_deltas_.begin() + published_);
+    published_ = 0;
+}
+
+template<BookViewObserver Observer>
+bool Runner::process_deltas(Observer& observer) {
+    if (g_conflate_threshold == 0 || published_ <= g_conflate_threshold) {
+        return drain_events([&](std::span<const DeltaChunk> chunks) {
+            return g_top_only ? deliver_top_event(chunks, observer) : deliver_event(chunks, observer);
+        });
+    }
+    
+    // Lagging consumer: fold the whole backlog, then deliver once per touched token
+    PerfProfile("conflate");
+    PerfProfileCount("conflated_backlog_chunks", published_);
+    drain_events([&](std::span<const DeltaChunk> chunks) {
+        fold_event(chunks);
+        return true;
+    });
+    return deliver_conflated(observer);
+}
+
+template<typename F>
+bool Runner::drain_events(F&& on_event) {
+    size_t i = 0;
+    while (i < published_) {
+        const DeltaChunk& chunk = shm_deltas_[i];
+        if (chunk.flags & ChunkPacked) {
+            // Demultiplex: rebuild each group as a standalone single-chunk event
+            size_t offset = 0;
+            for (uint8_t g = 0; g < chunk.num_deltas; ++g) {
+                const GroupHeader* group = reinterpret_cast<const GroupHeader*>(&chunk.payload[offset]);
+                DeltaChunk event;
+                event.token = group->token;
+                event.flags = ChunkFinal;
+                event.num_deltas = group->num_deltas;
+                event.summary = group->summary;
+                memcpy(event.payload, &chunk.payload[offset + sizeof(GroupHeader)], group->bytes);
+                offset += sizeof(GroupHeader) + group->bytes;
+                if (!on_event(std::span<const DeltaChunk>(&event, 1))) return false;
+            }
+            ++i;
+        } else {
+            size_t last = i;
+            while (!(shm_deltas_[last].flags & ChunkFinal)) ++last;
+            if (!on_event(std::span<const DeltaChunk>(&shm_deltas_[i], last - i + 1))) return false;
+            i = last + 1;
+        }
+    }
+    
+    // Drop consumed chunks; an open packed chunk (if any) stays for the publisher
+    shm_deltas_.erase(shm_deltas_.begin(), shm_deltas_.begin() + published_);
+    published_ = 0;
+    return true;
+}
+
+template<typename Sink>
+int Runner::apply_event(ReceiverState& receiver, std::span<const DeltaChunk> chunks, Sink&& emit) {
+    int num_records = apply_deltas_to_book(receiver, chunks, emit);
+    if (g_analytics_check) {
+        // The incremental sums must match a recompute from the book they describe
+        BookAnalytics recomputed;
+        recomputed.rebuild(false, receiver.book.bids);
+        recomputed.rebuild(true, receiver.book.asks);
+        always_assert(recomputed == receiver.analytics && "incremental analytics drifted from the book");
+        PerfProfileCount("analytics_checks", 1);
+    }
+    if (receiver.history) {
+        {
+            PerfProfile("book_history_record");
+            receiver.history->record(chunks, receiver.book);
+        }
+        if (g_history_check) check_history(chunks[0].token, receiver);
+    }
+    return num_records;
+}
+
+// Keeps a live copy of every book the history recorded and, per event, replays one lookback
+// (cycling through the whole depth) by both events_ago and record_idx and asserts it matches
+void Runner::check_history(Token token, const ReceiverState& receiver) {
+    HistoryShadow& shadow = history_shadows_[token];
+    if (shadow.books.empty()) shadow.books.resize(g_history_events);
+    size_t depth = shadow.books.size();
+    auto live_at = [&](size_t events_ago) -> const HistoricalBook& {
+        return shadow.books[(shadow.events - 1 - events_ago) % depth];
+    };
+    
+    const OutputRecord& book = receiver.book;
+    HistoricalBook& live = shadow.books[shadow.events++ % depth];
+    live.record_idx = book.record_idx;
+    live.bid_filled_lvls = book.bid_filled_lvls;
+    live.ask_filled_lvls = book.ask_filled_lvls;
+    memcpy(live.bids, book.bids, sizeof(book.bids));
+    memcpy(live.asks, book.asks, sizeof(book.asks));
+    
+    auto same = [](const HistoricalBook& a, const HistoricalBook& b) {
+        return a.record_idx == b.record_idx && a.bid_filled_lvls == b.bid_filled_lvls &&
+               a.ask_filled_lvls == b.ask_filled_lvls && memcmp(a.bids, b.bids, sizeof(a.bids)) == 0 &&
+               memcmp(a.asks, b.asks, sizeof(a.asks)) == 0;
+    };
+    size_t events_ago = (shadow.events * 7) % std::min<uint64_t>(shadow.events, depth);
+    HistoricalBook replayed;
+    if (!receiver.history->book_at(events_ago, replayed)) {
+        PerfProfileCount("history_check_evicted", 1);  // Chunk pressure from multi-chunk events
+        return;
+    }
+    always_assert(same(replayed, live_at(events_ago)) && "history replay differs from the live book");
+    
+    // By record: the last event with that record_idx (snapshots can repeat one)
+    size_t newest = events_ago;
+    while (newest > 0 && live_at(newest - 1).record_idx == live_at(events_ago).record_idx) --newest;
+    always_assert(receiver.history->book_at_record(live_at(events_ago).record_idx, replayed) &&
+                  same(replayed, live_at(newest)) && "history lookup by record differs from the live book");
+    PerfProfileCount("history_checks", 1);
+}
+
+template<typename Observer>
+bool Runner::deliver_event(std::span<const DeltaChunk> chunks, Observer& observer) {
+    // Records arrive in delivery order; after an abort the event is still fully applied
+    bool ok = true;
+    int num_records = apply_event(receiver_state(chunks[0].token), chunks, [&](const BookView& view) {
+        ok = ok && observer.on_book_view(view);
+    });
+    if (g_columnar_bench) {
+        const OutputRecord* reference = nullptr;
+        if constexpr (requires { observer.last_reference(); }) {
+            if (ok && num_records > 0) reference = observer.last_reference();
+        }
+        shadow_columnar(chunks, reference);
+    }
+    return ok;
+}
+
+template<typename Observer>
+bool Runner::deliver_top_event(std::span<const DeltaChunk> chunks, Observer& observer) {
+    ReceiverState& receiver = receiver_state(chunks[0].token);
+    if (!chunks[0].summary.touches_top()) {
+        PerfProfileCount("top_only_deferred_events", 1);
+        receiver.deferred.insert(receiver.deferred.end(), chunks.begin(), chunks.end());
+        if (receiver.deferred.size() >= kMaxDeferredChunks) apply_deferred(receiver);
+        if (g_columnar_bench) shadow_columnar(chunks);
+        return true;
+    }
+    
+    apply_deferred(receiver);
+    bool ok = true;
+    apply_event(receiver, chunks, [&](const BookView& view) {
+        ok = ok && observer.on_book_view(view);
+    });
+    if (g_columnar_bench) shadow_columnar(chunks);
+    return ok;
+}
+
+void Runner::apply_deferred(ReceiverState& receiver) {
+    if (receiver.deferred.empty()) return;
+    PerfProfile("apply_deferred");
+    
+    // Records are dropped; their changed levels carry over to the next delivered view
+    uint32_t changed[2] = {receiver.unreported_changed[0], receiver.unreported_changed[1]};
+    std::span<const DeltaChunk> pending(receiver.deferred);
+    size_t i = 0;
+    while (i < pending.size()) {
+        size_t last = i;
+        while (!(pending[last].flags & ChunkFinal)) ++last;
+        apply_event(receiver, pending.subspan(i, last - i + 1), [&](const BookView& view) {
+            changed[0] |= view.bid_changed;
+            changed[1] |= view.ask_changed;
+        });
+        i = last + 1;
+    }
+    receiver.unreported_changed[0] |= changed[0];
+    receiver.unreported_changed[1] |= changed[1];
+    receiver.deferred.clear();
+}
+
+const OutputRecord* Runner::current_book(Token token) {
+    ReceiverState* receiver = receivers_.find(token);
+    if (!receiver) return nullptr;
+    apply_deferred(*receiver);
+    return &receiver->book;
+}
+
+bool Runner::book_at(Token token, size_t events_ago, HistoricalBook& out) {
+    ReceiverState* receiver = receivers_.find(token);
+    if (!receiver || !receiver->history) return false;
+    apply_deferred(*receiver);
+    return receiver->history->book_at(events_ago, out);
+}
+
+bool Runner::book_at_record(Token token, uint32_t record_idx, HistoricalBook& out) {
+    ReceiverState* receiver = receivers_.find(token);
+    if (!receiver || !receiver->history) return false;
+    apply_deferred(*receiver);
+    return receiver->history->book_at_record(record_idx, out);
+}
+
+void Runner::fold_event(std::span<const DeltaChunk> chunks) {
+    Token token = chunks[0].token;
+    auto [it, inserted] = conflated_.try_emplace(token);
+    ConflatedBook& slot = it->second;
+    ReceiverState& receiver = receiver_state(token);
+    apply_deferred(receiver);
+    int num_records = apply_event(receiver, chunks, [&](const BookView& view) {
+        slot.bid_affected_lvl = std::min(slot.bid_affected_lvl, view.book->bid_affected_lvl);
+        slot.ask_affected_lvl = std::min(slot.ask_affected_lvl, view.book->ask_affected_lvl);
+        slot.bid_changed |= view.bid_changed;
+        slot.ask_changed |= view.ask_changed;
+    });
+    if (g_columnar_bench) shadow_columnar(chunks);
+    
+    if (num_records == 0) {
+        // Snapshot only: nothing would have been delivered for this event
+        if (inserted) {
+            conflated_.erase(it);
+        } else {
+            slot.bid_changed = slot.ask_changed = BookView::kAllLevels;
+        }
+        return;
+    }
+    slot.last_seq = fold_seq_++;
+    slot.events++;
+}
+
+template<typename Observer>
+bool Runner::deliver_conflated(Observer& observer) {
+    // Deliver in order of each token's last event so cross-token ordering is preserved
+    conflated_order_.clear();
+    for (const auto& [token, slot] : conflated_) conflated_order_.emplace_back(slot.last_seq, token);
+    std::sort(conflated_order_.begin(), conflated_order_.end());
+    
+    // The receiver book holds the last record its last event emitted, with the current
+    // levels (including any snapshot applied since)
+    bool ok = true;
+    for (const auto& [seq, token] : conflated_order_) {
+        const ConflatedBook& slot = conflated_.find(token)->second;
+        ReceiverState& receiver = receiver_state(token);
+        OutputRecord& book = receiver.book;
+        PerfProfileCount("conflated_events_per_token", slot.events);
+        int8_t last_bid_affected = book.bid_affected_lvl;
+        int8_t last_ask_affected = book.ask_affected_lvl;
+        book.bid_affected_lvl = slot.bid_affected_lvl;
+        book.ask_affected_lvl = slot.ask_affected_lvl;
+        if constexpr (requires { observer.on_conflation(token, slot.events); }) {
+            ok = observer.on_conflation(token, slot.events);
+        }
+        ok = ok && observer.on_book_view(BookView{&book, &receiver.analytics, slot.bid_changed, slot.ask_changed});
+        book.bid_affected_lvl = last_bid_affected;
+        book.ask_affected_lvl = last_ask_affected;
+        if (!ok) break;
+    }
+    conflated_.clear();
+    fold_seq_ = 0;
+    return ok;
+}
+
+void Runner::shadow_columnar(std::span<const DeltaChunk> chunks, const OutputRecord* reference) {
+    ColumnarBook& columnar = columnar_books_[chunks[0].token];
+    {
+        PerfProfile("apply_deltas_columnar");
+        apply_deltas(chunks, columnar);
+    }
+    
+    OutputLevel bids[20], asks[20];
+    {
+        PerfProfile("columnar_to_output_levels");
+        columnar.to_output_levels(bids, asks);
+    }
+    const ReceiverState& receiver = receiver_state(chunks[0].token);
+    if (!receiver.deferred.empty()) return;  // Top-only: receiver book is behind until requested
+    const OutputRecord& book = receiver.book;
+    always_assert(memcmp(bids, book.bids, sizeof(bids)) == 0 && memcmp(asks, book.asks, sizeof(asks)) == 0);
+    always_assert(columnar.filled_levels(false) == book.bid_filled_lvls &&
+                  columnar.filled_levels(true) == book.ask_filled_lvls);
+    
+    // The builder could share a bug with the columnar book, so also check the reference
+    if (reference && reference->token == book.token && reference->record_idx == book.record_idx) {
+        always_assert(memcmp(bids, reference->bids, sizeof(bids)) == 0 &&
+                      memcmp(asks, reference->asks, sizeof(asks)) == 0 &&
+                      "columnar book differs from the reference");
+        always_assert(columnar.filled_levels(false) == reference->bid_filled_lvls &&
+                      columnar.filled_levels(true) == reference->ask_filled_lvls &&
+                      "columnar filled levels differ from the reference");
+        PerfProfileCount("columnar_reference_checks", 1);
+    }
+}
+
+unique_ptr<Runner::TokenState> Runner::extract_token(Token token) {
+    always_assert(published_ == 0 && !pack_open_ && "deltas must be drained before migration");
+    auto state = make_unique<TokenState>();
+    mbos_.take(token, state->mbo);
+    receivers_.take(token, state->receiver);
+    if (auto it = columnar_books_.find(token); it != columnar_books_.end()) {
+        state->columnar.emplace(std::move(it->second));
+        columnar_books_.erase(it);
+    }
+    history_shadows_.erase(token);  // The adopter starts a fresh shadow of the moved history
+    return state;
+}
+
+void Runner::adopt_token(Token token, unique_ptr<TokenState> state) {
+    always_assert(!mbos_.find(token) && !receivers_.find(token) && "token already owned");
+    if (state->mbo) mbos_.get_or_create(token, std::move(*state->mbo)).set_emitter(&emitter_);
+    if (state->receiver) receivers_.get_or_create(token, std::move(*state->receiver));
+    if (state->columnar) columnar_books_.emplace(token, std::move(*state->columnar));
+}
+
+void Runner::warm_up(std::span<const ContractSpec> contracts, size_t rounds) {
+    for (const ContractSpec& contract : contracts) {
+        MBO& mbo = mbos_.get_or_create(contract.token, contract.token, &emitter_, arena_);
+        mbo.presize(contract.expected_orders, contract.expected_levels);
+        mbo.prefault();
+        receiver_state(contract.token);
+    }
+    
+    // Synthetic session per round and token: build 20 levels a side, modify, partially
+    // trade, then cancel everything, draining deltas as the strategy would
+    struct NullObserver {
+        bool on_book_view(const BookView&) { return true; }
+    } null_observer;
+    constexpr int kLevels = 20;
+    constexpr Price kMid = 1'000'000, kTick = 5;
+    for (size_t round = 0; round < rounds; ++round) {
+        for (const ContractSpec& contract : contracts) {
+            InputRecord rec{};
+            rec.token = contract.token;
+            auto send = [&](char type, OrderId id, OrderId id2, bool is_ask, Price price, Qty qty) {
+                rec.tick_type = type;
+                rec.order_id = id;
+                rec.order_id2 = id2;
+                rec.is_ask = is_ask;
+                rec.price = price;
+                rec.qty = qty;
+                process_record(rec);
+                process_deltas(null_observer);
+                ++rec.record_idx;
+            };
+            for (int k = 0; k < kLevels; ++k) {
+                send('N', 2 * k + 1, 0, false, kMid - kTick * (k + 1), 10);
+                send('N', 2 * k + 2, 0, true, kMid + kTick * (k + 1), 10);
+            }
+            send('M', 1, 0, false, kMid - kTick, 20);
+            send('T', 1, 0, false, kMid - kTick, 1);
+            for (int k = 0; k < kLevels; ++k) {
+                send('X', 2 * k + 1, 0, false, kMid - kTick * (k + 1), 0);
+                send('X', 2 * k + 2, 0, true, kMid + kTick * (k + 1), 0);
+            }
+        }
+        // Each round restarts record_idx, which per-token history requires to be non-decreasing
+        flush_deltas();
+        process_deltas(null_observer);
+        reset_state();
+    }
+    flush_deltas();
+    process_deltas(null_observer);
+    reset_state();
+}
+
+void Runner::reset_state() {
+    mbos_.for_each([](Token, MBO& mbo) { mbo.reset(); });
+    receivers_.for_each([](Token, ReceiverState& receiver) {
+        receiver.book = OutputRecord{};
+        receiver.analytics = BookAnalytics{};
+        receiver.agg_state = PendingAggressorState{};
+        receiver.unreported_changed[0] = receiver.unreported_changed[1] = 0;
+        receiver.deferred.clear();
+        if (receiver.history) receiver.history->clear();
+    });
+    columnar_books_.clear();
+    history_shadows_.clear();
+    shm_deltas_.clear();
+    published_ = 0;
+    pack_offset_ = 0;
+    pack_open_ = false;
+    conflated_.clear();
+}
+
+void Runner::track_residency(MBO& mbo) {
+    if (residency_now_ns_ == 0) [[unlikely]] residency_now_ns_ = PerfProfileNs();
+    if (mbo.is_cold()) [[unlikely]] {
+        uint64_t start = PerfProfileNs();
+        mbo.rehydrate();
+        uint64_t ns = PerfProfileNs() - start;
+        ++rehydrations_;
+        rehydrate_ns_ += ns;
+        rehydrate_max_ns_ = std::max(rehydrate_max_ns_, ns);
+    }
+    mbo.touch(residency_now_ns_);
+    if (++records_since_sweep_ == kResidencySweepRecords) sweep_residency();
+}
+
+void Runner::sweep_residency() {
+    records_since_sweep_ = 0;
+    residency_now_ns_ = PerfProfileNs();
+    size_t compacted = 0;
+    mbos_.for_each([&](Token, MBO& mbo) {
+        // A pending cross still needs its fill tracking, so that book stays hot
+        if (mbo.is_cold() || mbo.cross_pending()) return;
+        if (residency_now_ns_ - mbo.last_active_ns() < g_cold_after_ns) return;
+        mbo.make_cold();
+        ++compacted;
+    });
+    if (compacted) PerfProfileCount("residency_compacted", compacted);
+    uint64_t ns = PerfProfileNs() - residency_now_ns_;
+    ++sweeps_;
+    sweep_ns_ += ns;
+    sweep_max_ns_ = std::max(sweep_max_ns_, ns);
+}
+
+void Runner::report_active_orders() const {
+    mbos_.for_each([](Token, const MBO& mbo) {
+        PerfProfileCount("active_orders", mbo.order_map_.size());
+        PerfProfileCount("active_levels", mbo.bids_.levels_.size() + mbo.asks_.levels_.size());
+        // Count is the number of books, total the cold ones
+        if (g_cold_after_ns) PerfProfileCount("residency_cold_books", mbo.is_cold());
+    });
+    if (g_cold_after_ns && sweeps_) {
+        // One write per line: shard workers report concurrently
+        char line[192];
+        snprintf(line, sizeof(line), "Residency: %zu sweeps, avg %.1f us, max %.1f us; %zu rehydrations, avg %.1f us, max %.1f us\n",
+                 sweeps_, sweep_ns_ / 1e3 / sweeps_, sweep_max_ns_ / 1e3, rehydrations_,
+                 rehydrations_ ? rehydrate_ns_ / 1e3 / rehydrations_ : 0.0, rehydrate_max_ns_ / 1e3);
+        cout << line << std::flush;
+    }
+}
+
+// --- SPSC Ring ---
+// Bounded lock-free single-producer/single-consumer queue between pinned threads. Slots
+// are written and read in place (claim/publish, front/pop), so large messages are never
+// copied through a temporary; each side caches the other's index to avoid touching the
+// shared cache line on every call.
+template<typename T, size_t Capacity>
+class SpscRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+public:
+    // Producer: slot to fill, or nullptr if full; publish() makes it visible
+    T* try_claim() {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_cache_ == Capacity) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head - tail_cache_ == Capacity) return nullptr;
+        }
+        return &slots_[head & (Capacity - 1)];
+    }
+    void publish() { head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+    
+    // Consumer: oldest published slot, or nullptr if empty; pop() releases it
+    T* try_front() {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_cache_) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail == head_cache_) return nullptr;
+        }
+        return &slots_[tail & (Capacity - 1)];
+    }
+    void pop() { tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+    
+    size_t size() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    alignas(64) std::atomic<size_t> head_{0};
+    size_t tail_cache_ = 0;  // Producer's view of tail_
+    alignas(64) std::atomic<size_t> tail_{0};
+    size_t head_cache_ = 0;  // Consumer's view of head_
+    alignas(64) T slots_[Capacity];
+};
+
+// --- Thread Placement ---
+// Runtime CPU assignment for each thread role (--cpu-*). A thread is placed before it
+// constructs its Runner, so under the local memory policy the Runner's books are first
+// touched, and therefore allocated, on the NUMA node of the CPU that will use them. A
+// role left at -1 keeps the defaults below (main floating, shard worker i on CPU i+1,
+// pipeline publisher on 1 and strategy on 2).
+struct PlannedThread {
+    const char* role;
+    int cpu;          // -1: floating
+    bool configured;  // From a --cpu-* flag (only these may run SCHED_FIFO)
+};
+
+struct ThreadPlacement {
+    int main = -1;         // Single-threaded book builder, pipeline strategy, or shard merger
+    int publisher = -1;    // Pipeline publisher
+    int dispatcher = -1;   // Shard dispatcher
+    std::vector<int> workers;  // Shard workers by index; short lists fall back to the default
+    int fifo_priority = 0;     // SCHED_FIFO priority for explicitly placed threads (0 = stay on CFS)
+    
+    int worker(size_t index) const { return index < workers.size() ? workers[index] : -1; }
+    static int default_cpu(size_t cpu) {
+        return static_cast<int>(cpu % std::max(1u, std::thread::hardware_concurrency()));
+    }
+    
+    bool configured() const { return main >= 0 || publisher >= 0 || dispatcher >= 0 || !workers.empty(); }
+    
+    // Every thread the run will start and where it lands, defaults included
+    std::vector<PlannedThread> plan(size_t num_shards, bool pipelined) const {
+        auto with_default = [](const char* role, int cpu, size_t fallback) {
+            return PlannedThread{role, cpu >= 0 ? cpu : default_cpu(fallback), cpu >= 0};
+        };
+        std::vector<PlannedThread> threads;
+        if (num_shards > 0) {
+            threads.push_back({"main", main, main >= 0});
+            threads.push_back({"dispatcher", dispatcher, dispatcher >= 0});
+            for (size_t i = 0; i < num_shards; ++i) threads.push_back(with_default("shard worker", worker(i), i + 1));
+        } else if (pipelined) {
+            threads.push_back(with_default("publisher", publisher, 1));
+            threads.push_back(with_default("strategy", main, 2));
+        } else {
+            threads.push_back({"main", main, main >= 0});
+        }
+        return threads;
+    }
+    
+    // Every stage busy-polls, so a FIFO thread sharing its CPU with any other pinned thread
+    // (configured or default) would starve it forever
+    static bool fifo_cpu_shared(const std::vector<PlannedThread>& threads) {
+        for (const PlannedThread& a : threads) {
+            for (const PlannedThread& b : threads) {
+                if (&a != &b && a.configured && a.cpu == b.cpu) return true;
+            }
+        }
+        return false;
+    }
+    
+    // The process mask before main() placed anything: threads spawned by a pinned thread
+    // inherit its mask, and floating roles go back to this one
+    void save_initial_affinity() {
+        has_initial_affinity = sched_getaffinity(0, sizeof(initial_affinity), &initial_affinity) == 0;
+    }
+    cpu_set_t initial_affinity;
+    bool has_initial_affinity = false;
+};
+
+inline ThreadPlacement g_placement;
+
+// "2,4-7" -> {2, 4, 5, 6, 7}; the format of --cpu-workers and /sys/devices/system/cpu/isolated
+static std::vector<int> parse_cpu_list(const char* list) {
+    std::vector<int> cpus;
+    while (*list) {
+        char* end;
+        long first = strtol(list, &end, 10);
+        if (end == list) { ++list; continue; }
+        long last = first;
+        if (*end == '-') last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last; ++cpu) cpus.push_back(static_cast<int>(cpu));
+        list = end;
+    }
+    return cpus;
+}
+
+// Best effort: pins the calling thread to its configured CPU, else to fallback (< 0 leaves it
+// floating), makes its future allocations node-local and, for configured CPUs only, applies
+// SCHED_FIFO. New threads inherit their creator's mask and policy, so a floating or
+// unconfigured role explicitly drops both. A failed step only costs determinism, so it is
+// reported and ignored.
+inline void place_current_thread(int configured, int fallback, const char* role) {
+    int cpu = configured >= 0 ? configured : fallback;
+    if (cpu < 0 && g_placement.has_initial_affinity) {
+        pthread_setaffinity_np(pthread_self(), sizeof(g_placement.initial_affinity), &g_placement.initial_affinity);
+    }
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            cerr << "Warning: could not pin " << role << " thread to CPU " << cpu << endl;
+        }
+        // Overrides an inherited interleave/bind policy (e.g. numactl); no-op on one node
+        syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0);
+    }
+    // main() only keeps fifo_priority when no FIFO thread shares its CPU (fifo_cpu_shared)
+    sched_param param{};
+    if (configured >= 0 && g_placement.fifo_priority > 0) {
+        param.sched_priority = g_placement.fifo_priority;
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+            cerr << "Warning: could not set SCHED_FIFO " << param.sched_priority
+                 << " for " << role << " thread (needs CAP_SYS_NICE)" << endl;
+        }
+    } else if (int policy; pthread_getschedparam(pthread_self(), &policy, &param) == 0 && policy != SCHED_OTHER) {
+        param.sched_priority = 0;
+        pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    }
+}
+
+// Locks current and future mappings; MCL_ONFAULT locks pages as they are touched instead of
+// faulting in the whole input mapping up front
+static bool lock_process_memory() {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == 0) return true;
+    cerr << "Warning: mlockall failed: " << strerror(errno)
+         << " (raise RLIMIT_MEMLOCK or run with CAP_IPC_LOCK)" << endl;
+    return false;
+}
+
+// First line of a sysfs file, without the newline; empty if unreadable
+static string read_sysfs(const string& path) {
+    char line[256] = {};
+    if (FILE* f = fopen(path.c_str(), "r")) {
+        if (!fgets(line, sizeof(line), f)) line[0] = 0;
+        fclose(f);
     }
+    line[strcspn(line, "\n")] = 0;
+    return line;
+}
+
+// Host checks for a latency run, reported before the replay starts: THP mode, the frequency
+// governor, online state and isolcpus membership of every pinned CPU (defaults included),
+// and whether memory got locked. Warnings only; the run proceeds either way.
+static void report_preflight(const std::vector<PlannedThread>& threads, bool hugepages,
+                             bool mlock_requested, bool mlock_ok) {
+    size_t warnings = 0;
+    auto warn = [&](const string& message) {
+        cerr << "Preflight warning: " << message << endl;
+        ++warnings;
+    };
     
-    // Publisher context: process input record, emit deltas to SHM buffer
-    void process_record(const InputRecord& rec);
+    string thp = read_sysfs("/sys/kernel/mm/transparent_hugepage/enabled");
+    if (thp.find("[always]") != string::npos) {
+        warn("THP is 'always': khugepaged collapses and compaction stalls can hit the hot path; prefer 'madvise'");
+    } else if (hugepages && thp.find("[never]") != string::npos) {
+        warn("THP is 'never': the --hugepages fallback mapping stays on 4KB pages");
+    }
     
-    // Strategy context: apply deltas to reconstructed book, deliver snapshots via observer.
-    // Returns false if observer requested abort.
-    bool process_deltas(BookObserver& observer);
+    std::vector<int> cpus;
+    for (const PlannedThread& thread : threads) {
+        if (thread.cpu >= 0) cpus.push_back(thread.cpu);
+    }
+    std::sort(cpus.begin(), cpus.end());
+    if (std::adjacent_find(cpus.begin(), cpus.end()) != cpus.end()) {
+        warn("several threads share a CPU; their busy-poll loops will time-slice");
+    }
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
     
-    void report_active_orders() const;
+    // The online set can have gaps (hot-unplugged CPUs), so test membership, not a count
+    string online_list = read_sysfs("/sys/devices/system/cpu/online");
+    std::vector<int> online = parse_cpu_list(online_list.c_str());
+    std::vector<int> isolated = parse_cpu_list(read_sysfs("/sys/devices/system/cpu/isolated").c_str());
+    for (int cpu : cpus) {
+        if (!online_list.empty() && std::find(online.begin(), online.end(), cpu) == online.end()) {
+            warn("CPU " + std::to_string(cpu) + " is not online (online: " + online_list + ")");
+            continue;
+        }
+        string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+        string governor = read_sysfs(base + "/cpufreq/scaling_governor");
+        if (!governor.empty() && governor != "performance") {
+            warn("CPU " + std::to_string(cpu) + " uses the '" + governor + "' frequency governor, not 'performance'");
+        }
+        if (std::find(isolated.begin(), isolated.end(), cpu) == isolated.end()) {
+            warn("CPU " + std::to_string(cpu) + " is not in isolcpus; other tasks may be scheduled on it");
+        }
+    }
+    if (!g_placement.configured()) warn("no --cpu-* placement given");
+    if (mlock_requested && !mlock_ok) warn("memory is not locked; page faults and swap-outs stay possible");
+    
+    cout << "Preflight: " << warnings << " warning(s), THP " << (thp.empty() ? "unknown" : thp)
+         << ", " << cpus.size() << " pinned CPU(s), " << isolated.size() << " isolated" << endl;
+}
+
+// --- Sharded Runner ---
+// Token-sharded pipeline: a dispatcher thread routes each InputRecord to the worker that
+// owns its token over an SPSC ring, and every worker runs its own Runner (MBOs, SHM delta
+// ring, receiver books) on a pinned core. A token is owned by one worker at a time, so
+// per-token order holds without any cross-worker synchronization.
+// Sequenced mode (validation): workers publish and drain deltas after every record and
+// copy each delivered record into their output ring tagged with the input position, then
+// an end marker; run() merges the rings back into input order on the calling thread.
+// Unsequenced mode discards delivered records and only measures throughput.
+// Rebalancing: workers account TSC cycles per token; every kRebalanceInterval records the
+// dispatcher compares shard load over the interval and moves the busiest shard's hottest
+// token to the idlest shard when that narrows the gap (see migrate()).
+class ShardedRunner {
+public:
+    ShardedRunner(size_t num_shards, bool sequenced, bool rebalance)
+        : shards_(num_shards), sequenced_(sequenced), rebalance_(rebalance) {
+        always_assert(num_shards > 0 && num_shards <= 255);
+        for (auto& shard : shards_) shard = make_unique<Shard>();
+    }
+    
+    // Pre-session: each worker warms up the listed contracts it initially owns
+    void set_warm_up(std::span<const ContractSpec> contracts, size_t rounds) {
+        warm_contracts_ = contracts;
+        warm_rounds_ = rounds;
+    }
+    
+    // Process all records; in sequenced mode observer receives every delivered view in
+    // input order. Returns false if the observer requested abort.
+    template<BookViewObserver Observer>
+    bool run(const InputRecord* records, size_t num_records, Observer& observer);
 
 private:
-    // --- Publisher state ---
-    boost::unordered::unordered_flat_map<Token, unique_ptr<MBO>> mbos_;
+    static constexpr size_t kRebalanceInterval = 1 << 16;  // Input records between load checks
+    static constexpr double kImbalanceRatio = 1.25;        // Busiest/idlest load that triggers a move
+    static constexpr uint64_t kHotCyclesMask = (1ull << 40) - 1;
     
-    // --- SHM simulation (deltas produced by last process_record) ---
-    std::vector<DeltaChunk> shm_deltas_;
+    enum class ShardOp : uint8_t { Record, Release, Adopt, Stop };
     
-    // --- Strategy/receiver state ---
-    boost::unordered::unordered_flat_map<Token, OutputRecord> reconstructed_books_;
-    boost::unordered::unordered_flat_map<Token, PendingAggressorState> aggressor_states_;
+    struct ShardInput {
+        uint64_t seq;          // Input position (Record)
+        ShardOp op;
+        InputRecord rec;       // Record; only the token for Release/Adopt
+    };
+    struct ShardOutput {
+        uint64_t seq;
+        bool end;              // No more records for input seq
+        ViewCopy view;
+    };
+    struct Shard {
+        SpscRing<ShardInput, 4096> input;
+        SpscRing<ShardOutput, 1024> output;
+        // Load report, written by the worker only
+        alignas(64) std::atomic<uint64_t> busy_cycles{0};  // Cumulative, all tokens
+        std::atomic<uint64_t> hot{0};  // Hottest token this epoch: token << 40 | cycles
+        uint64_t output_wait_cycles = 0;  // Worker only: spent in claim_output waiting on the merger
+    };
+    struct Route {
+        size_t shard;
+    };
+    struct TokenLoad {
+        uint64_t cycles = 0;
+        uint64_t epoch = 0;
+    };
+    
+    // Copies each delivered view into the worker's output ring
+    struct OutputSink {
+        ShardedRunner& owner;
+        Shard& shard;
+        uint64_t seq;
+        bool on_book_view(const BookView& view) {
+            if (ShardOutput* msg = owner.claim_output(shard)) {
+                msg->seq = seq;
+                msg->end = false;
+                msg->view.assign(view);
+                shard.output.publish();
+            }
+            return true;
+        }
+    };
+    struct NullSink {
+        bool on_book_view(const BookView&) { return true; }
+    };
+    
+    void dispatch(const InputRecord* records, size_t num_records);
+    void push(size_t shard, ShardOp op, uint64_t seq, const InputRecord& rec);
+    void rebalance(TokenDirectory<Route>& routes, std::vector<uint64_t>& last_busy);
+    void migrate(Token token, size_t from, size_t to);
+    void work(size_t index);
+    
+    // Spin for an output slot; nullptr once aborted (nobody is draining any more). The
+    // spin is merger backpressure, not token work, so it is kept out of the load figures.
+    ShardOutput* claim_output(Shard& shard) {
+        ShardOutput* msg = shard.output.try_claim();
+        if (msg) [[likely]] return msg;
+        uint64_t start = PerfProfileTsc();
+        while (!(msg = shard.output.try_claim())) {
+            if (abort_.load(std::memory_order_relaxed)) break;
+            _mm_pause();
+        }
+        shard.output_wait_cycles += PerfProfileTsc() - start;
+        return msg;
+    }
+    
+    std::vector<unique_ptr<Shard>> shards_;
+    bool sequenced_;
+    bool rebalance_;
+    std::span<const ContractSpec> warm_contracts_;
+    size_t warm_rounds_ = 0;
+    std::atomic<bool> abort_{false};
+    
+    // Sequenced mode: owning shard of each input, published up to dispatched_
+    std::vector<uint8_t> routes_;
+    alignas(64) std::atomic<size_t> dispatched_{0};
+    
+    // Rebalancing: load epoch (bumped per check) and the single in-flight handoff
+    alignas(64) std::atomic<uint64_t> epoch_{0};
+    std::atomic<Runner::TokenState*> handoff_{nullptr};
+    std::atomic<size_t> migrations_done_{0};
+    size_t migrations_started_ = 0;  // Dispatcher only
 };
 
-void Runner::process_record(const InputRecord& rec) {
-    PerfProfileCount("records_processed", 1);
-    rec.print();
+template<BookViewObserver Observer>
+bool ShardedRunner::run(const InputRecord* records, size_t num_records, Observer& observer) {
+    if (sequenced_) routes_.resize(num_records);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < shards_.size(); ++i) workers.emplace_back([this, i] { work(i); });
+    std::thread dispatcher([&] { dispatch(records, num_records); });
+    
+    bool ok = true;
+    if (sequenced_) {
+        for (size_t i = 0; i < num_records && ok; ++i) {
+            if constexpr (requires { observer.set_current_input(i); }) observer.set_current_input(i);
+            while (dispatched_.load(std::memory_order_acquire) <= i) _mm_pause();
+            Shard& shard = *shards_[routes_[i]];
+            while (true) {
+                ShardOutput* msg;
+                while (!(msg = shard.output.try_front())) _mm_pause();
+                always_assert(msg->seq == i && "shard output out of input order");
+                if (msg->end) {
+                    shard.output.pop();
+                    break;
+                }
+                ok = observer.on_book_view(msg->view.view());
+                shard.output.pop();
+                if (!ok) break;
+            }
+        }
+        if (!ok) abort_.store(true, std::memory_order_relaxed);
+    }
+    
+    dispatcher.join();
+    for (auto& worker : workers) worker.join();
+    return ok;
+}
 
-    Token token = rec.token;
-    auto it = mbos_.find(token);
-    if (it == mbos_.end()) {
-        it = mbos_.emplace(token, make_unique<MBO>(token)).first;
+void ShardedRunner::push(size_t shard, ShardOp op, uint64_t seq, const InputRecord& rec) {
+    ShardInput* msg;
+    while (!(msg = shards_[shard]->input.try_claim())) {
+        PerfProfileCount("shard_dispatch_full_spins", 1);
+        _mm_pause();
     }
+    msg->seq = seq;
+    msg->op = op;
+    msg->rec = rec;
+    shards_[shard]->input.publish();
+}
 
-    PerfProfile("got_mbo");
-    MBO& mbo = *it->second;
-    
-    mbo.prepare_deltas(token, rec.record_idx);
+void ShardedRunner::dispatch(const InputRecord* records, size_t num_records) {
+    place_current_thread(g_placement.dispatcher, -1, "dispatcher");
+    TokenDirectory<Route> routes;  // Current owner of each token
+    std::vector<uint64_t> last_busy(shards_.size(), 0);
     
-    switch (rec.tick_type) {
-        case 'N': {PerfProfile("new_order"); mbo.new_order(rec.order_id, rec.is_ask, rec.price, rec.qty); break;}
-        case 'M': {PerfProfile("modify_order"); mbo.modify_order(rec.order_id, rec.price, rec.qty); break;}
-        case 'X': {PerfProfile("cancel_order"); mbo.cancel_order(rec.order_id); break;}
-        case 'T': {PerfProfile("trade"); mbo.trade(rec.order_id, rec.order_id2, rec.price, rec.qty); break;}
+    for (size_t i = 0; i < num_records && !abort_.load(std::memory_order_relaxed); ++i) {
+        if (rebalance_ && i && i % kRebalanceInterval == 0) rebalance(routes, last_busy);
+        Token token = records[i].token;
+        size_t shard = routes.get_or_create(token, Route{token % shards_.size()}).shard;
+        if ((i & 1023) == 0) PerfProfileCount("shard_input_depth", shards_[shard]->input.size());
+        if (sequenced_) {
+            routes_[i] = static_cast<uint8_t>(shard);
+            dispatched_.store(i + 1, std::memory_order_release);
+        }
+        push(shard, ShardOp::Record, i, records[i]);
+    }
+    for (size_t shard = 0; shard < shards_.size(); ++shard) push(shard, ShardOp::Stop, 0, InputRecord{});
+}
+
+void ShardedRunner::rebalance(TokenDirectory<Route>& routes, std::vector<uint64_t>& last_busy) {
+    // Load of each shard since the previous check; the epoch bump restarts per-token counts
+    std::vector<uint64_t> load(shards_.size());
+    size_t busiest = 0, idlest = 0;
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        uint64_t busy = shards_[s]->busy_cycles.load(std::memory_order_relaxed);
+        load[s] = busy - last_busy[s];
+        last_busy[s] = busy;
+        if (load[s] > load[busiest]) busiest = s;
+        if (load[s] < load[idlest]) idlest = s;
     }
+    uint64_t hot = shards_[busiest]->hot.load(std::memory_order_relaxed);
+    epoch_.fetch_add(1, std::memory_order_relaxed);
     
-    mbo.finalize_deltas();
+    if (migrations_done_.load(std::memory_order_acquire) != migrations_started_) return;
+    if (load[busiest] <= load[idlest] * kImbalanceRatio) return;
+    
+    // Moving the hot token helps only if it is smaller than the gap it closes
+    Token token = static_cast<Token>(hot >> 40);
+    uint64_t cycles = hot & kHotCyclesMask;
+    Route* route = routes.find(token);
+    if (!route || route->shard != busiest || cycles >= load[busiest] - load[idlest]) return;
+    
+    PerfProfileCount("shard_migrations", 1);
+    migrate(token, busiest, idlest);
+    route->shard = idlest;
+}
 
-    // Copy deltas to SHM buffer (simulates publisher writing to shared memory)
-    auto chunks = mbo.get_delta_chunks();
-    shm_deltas_.assign(chunks.begin(), chunks.end());
+// Handoff protocol: Release on the old owner follows the token's earlier records, Adopt
+// on the new owner precedes its later ones. The old owner drains its deltas and passes
+// the token's state through handoff_; the new owner blocks at Adopt until it arrives, so
+// the token's events stay in order. The wait can't deadlock: the old owner only needs
+// inputs already queued, and in sequenced mode the merger consumes everything before the
+// migration point first.
+void ShardedRunner::migrate(Token token, size_t from, size_t to) {
+    InputRecord rec{};
+    rec.token = token;
+    ++migrations_started_;
+    push(from, ShardOp::Release, 0, rec);
+    push(to, ShardOp::Adopt, 0, rec);
+}
+
+void ShardedRunner::work(size_t index) {
+    place_current_thread(g_placement.worker(index), ThreadPlacement::default_cpu(index + 1), "shard worker");
+    char tag[8];
+    snprintf(tag, sizeof(tag), "s%zu", index);
+    PerfProfiler::set_thread_tag(tag);  // Workers share every Runner stat
+    Shard& shard = *shards_[index];
+    Runner runner;  // Constructed on the worker so its state is first touched here
+    if (!warm_contracts_.empty()) {
+        std::vector<ContractSpec> owned;
+        for (const ContractSpec& contract : warm_contracts_) {
+            if (contract.token % shards_.size() == index) owned.push_back(contract);
+        }
+        runner.warm_up(owned, warm_rounds_);
+    }
+    NullSink null_sink;
+    TokenDirectory<TokenLoad> loads;
+    uint64_t epoch = 0;
+    uint64_t hot_cycles = 0;
     
-#ifndef printf
-    for (const auto& chunk : shm_deltas_) {
-        std::cout << "  " << chunk << "\n";
+    while (true) {
+        ShardInput* msg;
+        while (!(msg = shard.input.try_front())) _mm_pause();
+        ShardOp op = msg->op;
+        uint64_t seq = msg->seq;
+        Token token = msg->rec.token;
+        
+        if (op == ShardOp::Stop) {
+            shard.input.pop();
+            break;
+        }
+        if (op == ShardOp::Release) {
+            shard.input.pop();
+            runner.flush_deltas();
+            runner.process_deltas(null_sink);  // Sequenced mode has drained already
+            handoff_.store(runner.extract_token(token).release(), std::memory_order_release);
+            continue;
+        }
+        if (op == ShardOp::Adopt) {
+            shard.input.pop();
+            PerfProfile("shard_migration_wait");
+            Runner::TokenState* state;
+            while (!(state = handoff_.exchange(nullptr, std::memory_order_acquire))) _mm_pause();
+            runner.adopt_token(token, unique_ptr<Runner::TokenState>(state));
+            migrations_done_.fetch_add(1, std::memory_order_release);
+            continue;
+        }
+        
+        uint64_t start = rebalance_ ? PerfProfileTsc() : 0;
+        uint64_t waited = shard.output_wait_cycles;
+        runner.process_record(msg->rec);
+        shard.input.pop();
+        
+        if (!sequenced_) {
+            runner.process_deltas(null_sink);
+        } else {
+            runner.flush_deltas();
+            OutputSink sink{*this, shard, seq};
+            runner.process_deltas(sink);
+            if (ShardOutput* end = claim_output(shard)) {
+                end->seq = seq;
+                end->end = true;
+                shard.output.publish();
+            }
+        }
+        if (!rebalance_) continue;
+        
+        // Load accounting: per-token cycles restart each epoch, shard cycles accumulate.
+        // Deltas are applied while views are handed out, so output stalls are subtracted.
+        uint64_t cycles = PerfProfileTsc() - start - (shard.output_wait_cycles - waited);
+        uint64_t current = epoch_.load(std::memory_order_relaxed);
+        if (current != epoch) {
+            epoch = current;
+            hot_cycles = 0;
+        }
+        TokenLoad& load = loads.get_or_create(token);
+        if (load.epoch != epoch) load = TokenLoad{0, epoch};
+        load.cycles += cycles;
+        shard.busy_cycles.store(shard.busy_cycles.load(std::memory_order_relaxed) + cycles,
+                                std::memory_order_relaxed);
+        if (load.cycles > hot_cycles) {
+            hot_cycles = load.cycles;
+            shard.hot.store(uint64_t(token) << 40 | std::min(hot_cycles, kHotCyclesMask),
+                            std::memory_order_relaxed);
+        }
     }
-#endif
+    
+    runner.flush_deltas();
+    runner.process_deltas(null_sink);
+    runner.report_active_orders();
 }
 
-bool Runner::process_deltas(BookObserver& observer) {
-    if (shm_deltas_.empty()) return true;
+// --- Pipelined Runner ---
+// Production topology on two cores: stage one (publisher thread) runs the MBOs and pushes
+// every published chunk into an SPSC ring standing in for the SHM segment; stage two (the
+// calling thread) rebuilds books from the ring and runs the observer. Each stage owns its
+// own Runner, so the publisher's timing excludes book reconstruction and validation.
+// A consumer that falls behind sees the backlog, so --conflate applies naturally.
+class PipelinedRunner {
+public:
+    PipelinedRunner() : ring_(make_unique<ChunkRing>()) {}
     
-    Token token = shm_deltas_[0].token;
-    auto& reconstructed = reconstructed_books_[token];
-    auto& agg_state = aggressor_states_[token];
+    // Returns false if the observer requested abort
+    template<BookViewObserver Observer>
+    bool run(const InputRecord* records, size_t num_records, Observer& observer);
+
+private:
+    static constexpr size_t kConsumeBatch = 256;  // Chunks taken per consumer pass
+    // The input index rides along so the observer can name the record a view came from
+    struct PipelineSlot {
+        DeltaChunk chunk;
+        size_t input;
+    };
+    using ChunkRing = SpscRing<PipelineSlot, 16384>;
     
-    std::vector<OutputRecord> extra_records;
-    int num_records [[maybe_unused]] = apply_deltas_to_book(reconstructed, shm_deltas_, agg_state, &extra_records);
+    void publish(const InputRecord* records, size_t num_records);
+    void push(const DeltaChunk& chunk, size_t input) {
+        PipelineSlot* slot;
+        while (!(slot = ring_->try_claim())) {
+            if (abort_.load(std::memory_order_relaxed)) return;
+            PerfProfileCount("pipeline_ring_full_spins", 1);
+            _mm_pause();
+        }
+        slot->chunk = chunk;
+        slot->input = input;
+        ring_->publish();
+    }
     
-    // Deliver snapshots to observer in correct order:
-    // - Multi-tick (T+N/M/X): extras contain the T tick → deliver extras before main
-    // - C expansion (C+S+N): extras contain S and N → deliver main before extras
-    bool multi_tick_secondary = !extra_records.empty() && 
-        (extra_records[0].event.tick_type == 'T' || extra_records[0].event.tick_type == 'D' || 
-         extra_records[0].event.tick_type == 'E');
+    unique_ptr<ChunkRing> ring_;
+    std::atomic<bool> done_{false};   // Publisher pushed its last chunk
+    std::atomic<bool> abort_{false};
+    uint64_t publish_ns_ = 0;
+};
+
+void PipelinedRunner::publish(const InputRecord* records, size_t num_records) {
+    place_current_thread(g_placement.publisher, ThreadPlacement::default_cpu(1), "publisher");
+    PerfProfiler::set_thread_tag("pub");  // Its Runner stats would race the consumer's
+    Runner publisher;
+    size_t input = 0;
+    auto push_chunk = [this, &input](const DeltaChunk& chunk) { push(chunk, input); };
     
-    if (multi_tick_secondary) {
-        for (const auto& extra : extra_records) {
-            if (!observer.on_book_update(extra)) return false;
-        }
-        if (!observer.on_book_update(reconstructed)) return false;
-    } else {
-        if (!observer.on_book_update(reconstructed)) return false;
-        for (const auto& extra : extra_records) {
-            if (!observer.on_book_update(extra)) return false;
+    uint64_t start = PerfProfileNs();
+    for (; input < num_records && !abort_.load(std::memory_order_relaxed); ++input) {
+        {
+            PerfProfile("pipeline_publish");
+            publisher.process_record(records[input]);
         }
+        publisher.take_published(push_chunk);
     }
-    
-    return true;
+    // Tail flush: charge whatever it releases to the last record
+    input = num_records ? num_records - 1 : 0;
+    publisher.flush_deltas();
+    publisher.take_published(push_chunk);
+    publish_ns_ = PerfProfileNs() - start;
+    done_.store(true, std::memory_order_release);
 }
 
-void Runner::report_active_orders() const {
-    for (const auto& [token, mbo] : mbos_) {
-        PerfProfileCount("active_orders", mbo->order_map_.size());
-        PerfProfileCount("active_levels", mbo->bids_.levels_.size() + mbo->asks_.levels_.size());
+template<BookViewObserver Observer>
+bool PipelinedRunner::run(const InputRecord* records, size_t num_records, Observer& observer) {
+    std::thread publisher([&] { publish(records, num_records); });
+    // The calling thread becomes the strategy stage only for this run; its mask and policy
+    // are put back afterwards so later phases (reporting, teardown) don't stay on CPU 2
+    cpu_set_t caller_mask;
+    bool has_caller_mask = pthread_getaffinity_np(pthread_self(), sizeof(caller_mask), &caller_mask) == 0;
+    int caller_policy;
+    sched_param caller_param{};
+    bool has_caller_sched = pthread_getschedparam(pthread_self(), &caller_policy, &caller_param) == 0;
+    place_current_thread(g_placement.main, ThreadPlacement::default_cpu(2), "strategy");
+    Runner consumer;
+    
+    uint64_t start = PerfProfileNs();
+    size_t max_depth = 0;
+    size_t last_input = 0;
+    bool ok = true;
+    while (ok) {
+        bool done = done_.load(std::memory_order_acquire);
+        size_t depth = ring_->size();
+        if (depth == 0) {
+            if (done) break;
+            _mm_pause();
+            continue;
+        }
+        PerfProfileCount("pipeline_queue_depth", depth);
+        max_depth = std::max(max_depth, depth);
+        
+        for (size_t n = 0; n < kConsumeBatch; ++n) {
+            PipelineSlot* slot = ring_->try_front();
+            if (!slot) break;
+            consumer.receive_chunk(slot->chunk);
+            last_input = slot->input;
+            ring_->pop();
+        }
+        // A pass can span several records; like the batched main loop, report the last one
+        if constexpr (requires { observer.set_current_input(last_input); }) {
+            observer.set_current_input(last_input);
+        }
+        ok = consumer.process_deltas(observer);
     }
+    if (!ok) abort_.store(true, std::memory_order_relaxed);
+    uint64_t consume_ns = PerfProfileNs() - start;
+    publisher.join();
+    if (has_caller_mask) pthread_setaffinity_np(pthread_self(), sizeof(caller_mask), &caller_mask);
+    if (has_caller_sched) pthread_setschedparam(pthread_self(), caller_policy, &caller_param);
+    
+    // printf is compiled out for perf runs; this summary is wanted in them
+    cout << "Pipeline: publisher " << (publish_ns_ ? num_records * 1e3 / publish_ns_ : 0.0)
+         << " Mrec/s, consumer " << (consume_ns ? num_records * 1e3 / consume_ns : 0.0)
+         << " Mrec/s, max queue depth " << max_depth << " chunks" << endl;
+    return ok;
 }
 
 // --- Reference Validator (compares book snapshots against reference output) ---
-class ReferenceValidator : public BookObserver {
+class ReferenceValidator {
 public:
     ReferenceValidator(const OutputRecord* ref_books, size_t num_ref, const InputRecord* inputs)
         : ref_books_(ref_books), num_ref_(num_ref), inputs_(inputs) {}
     
     void set_current_input(size_t idx) { input_idx_ = idx; }
     
-    bool on_book_update(const OutputRecord& book) override {
-        book.print();
+    // Delivery skips whole events (top-only mode): resync on every view, without widening
+    void set_sparse_delivery(bool sparse) { sparse_ = sparse; }
+    
+    // Reference record the last view matched; null before the first match or without a reference
+    const OutputRecord* last_reference() const {
+        return ref_books_ && ref_idx_ > 0 && ref_idx_ <= num_ref_ ? &ref_books_[ref_idx_ - 1] : nullptr;
+    }
+    
+    bool on_conflation(Token /*token*/, uint32_t /*events_folded*/) {
+        conflated_ = true;
+        return true;
+    }
+    
+    bool on_book_view(const BookView& view) {
+        const OutputRecord& book_in = *view.book;
+        book_in.print();
         
         if (!ref_books_ || ref_idx_ >= num_ref_) {
             ref_idx_++;
             return true;
         }
         
+        // Conflated update: the reference records of the folded events were never delivered.
+        // Skip forward to this update's own record; its affected levels are the topmost
+        // across the folded events, so accept anything at or above the reference's.
+        // Sparse (top-only) delivery skips the same way but reports the event's own levels.
+        OutputRecord widened;
+        bool was_conflated = conflated_;
+        if (was_conflated || sparse_) {
+            conflated_ = false;
+            size_t idx = ref_idx_;
+            while (idx < num_ref_ && (ref_books_[idx].token != book_in.token ||
+                                      ref_books_[idx].record_idx != book_in.record_idx ||
+                                      ref_books_[idx].event.tick_type != book_in.event.tick_type)) {
+                ++idx;
+            }
+            if (idx == num_ref_) {
+                printf("RESYNC: no reference record for [%u] tok:%u tick:%c after ref_idx %lu\n",
+                       book_in.record_idx, book_in.token, book_in.event.tick_type, ref_idx_);
+                return false;
+            }
+            if (was_conflated) {
+                PerfProfileCount("conflation_skipped_refs", idx - ref_idx_);
+            } else {
+                PerfProfileCount("top_only_skipped_refs", idx - ref_idx_);
+            }
+            ref_idx_ = idx;
+        }
+        if (was_conflated) {
+            widened = book_in;
+            const OutputRecord& ref = ref_books_[ref_idx_];
+            if (widened.bid_affected_lvl <= ref.bid_affected_lvl) widened.bid_affected_lvl = ref.bid_affected_lvl;
+            if (widened.ask_affected_lvl <= ref.ask_affected_lvl) widened.ask_affected_lvl = ref.ask_affected_lvl;
+        }
+        const OutputRecord& book = was_conflated ? widened : book_in;
+        
 // printf("VERBOSE INPUT:\n");
 // records[input_idx-1].print();
 // printf("VERBOSE OURS: (compare result %d)\n", cmp);
@@ -1707,7 +4665,7 @@ public:
             [-20..-1]: bid level
             [+1..+20]: ask level
             */
-            inputs_[input_idx_].print();
+            if (inputs_) inputs_[input_idx_].print();  // Null when the input is streamed
             printf("MISMATCH at input %lu (ref_idx: %lu) - Error code: %d ", 
                    input_idx_ + 1, ref_idx_, cmp);
             if (cmp >= 100) printf("(metadata/counts)\n");
@@ -1731,14 +4689,17 @@ private:
     const InputRecord* inputs_;
     size_t ref_idx_ = 0;
     size_t input_idx_ = 0;
+    bool conflated_ = false;
+    bool sparse_ = false;
 };
 
 // --- Dump Observer (writes book snapshots to file) ---
-class DumpObserver : public BookObserver {
+class DumpObserver {
     FILE* f_;
 public:
     DumpObserver(FILE* f) : f_(f) {}
-    bool on_book_update(const OutputRecord& book) override {
+    bool on_book_view(const BookView& view) {
+        const OutputRecord& book = *view.book;
         fprintf(f_, "[%u] tok:%u tick:%c side:%s affected_bid:%d affected_ask:%d ltp:%ld ltq:%d\n",
                 book.record_idx, book.token, book.event.tick_type,
                 book.is_ask ? "ASK" : "BID",
@@ -1748,16 +4709,447 @@ public:
     }
 };
 
+// --- Streaming Input ---
+// Touches one byte per page of [begin, end) so the faults are taken here rather than inside
+// the code reading the records; returns the time spent. Input readers report the sum as stall.
+static uint64_t fault_in_pages(const void* begin, const void* end) {
+    uint64_t start = PerfProfileNs();
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (uintptr_t p = reinterpret_cast<uintptr_t>(begin) & ~(page - 1); p < reinterpret_cast<uintptr_t>(end); p += page) {
+        *reinterpret_cast<const volatile char*>(p);
+    }
+    return PerfProfileNs() - start;
+}
+
+// Bounded-RSS reader for whole-day replays (--stream-window MB). Rather than mapping the
+// whole file, it maps one window at a time and hands it out in quarter-window slices. Pages
+// behind the current slice are dropped with MADV_DONTNEED and the next slice is prefetched
+// (near a window's end, the next window's file range via the page cache), so residency stays
+// around one window however large the file. Each slice is faulted in before it is handed out,
+// so the time spent waiting for the file shows up as stall_ns() rather than inside
+// process_record. A slice is valid until the next call to next().
+class StreamingInput {
+public:
+    StreamingInput(int fd, size_t file_bytes, size_t window_bytes)
+        : fd_(fd), num_records_(file_bytes / sizeof(InputRecord)),
+          window_records_(std::max((window_bytes + sizeof(InputRecord) - 1) / sizeof(InputRecord), kSlices)) {}
+    ~StreamingInput() { unmap(); }
+    StreamingInput(const StreamingInput&) = delete;
+    StreamingInput& operator=(const StreamingInput&) = delete;
+    
+    // Next slice of whole records; empty at end of file or if a window couldn't be mapped
+    std::span<const InputRecord> next() {
+        if (next_ == num_records_ || failed_) return {};
+        if (next_ == window_end_ && !map_window(next_)) return {};
+        size_t count = std::min(window_records_ / kSlices, window_end_ - next_);
+        const InputRecord* first = record(next_);
+        release_behind(reinterpret_cast<const char*>(first));
+        prefetch(next_ + count, count);
+        stall_ns_ += fault_in_pages(first, first + count);
+        next_ += count;
+        return {first, count};
+    }
+    
+    bool failed() const { return failed_; }
+    uint64_t stall_ns() const { return stall_ns_; }
+    size_t windows() const { return windows_; }
+    size_t window_bytes() const { return window_records_ * sizeof(InputRecord); }
+
+private:
+    static constexpr size_t kSlices = 4;
+    
+    // Maps records [first, first + window_records_) from the page containing the first one
+    bool map_window(size_t first) {
+        unmap();
+        size_t page = sysconf(_SC_PAGESIZE);
+        window_end_ = std::min(first + window_records_, num_records_);
+        map_offset_ = first * sizeof(InputRecord) / page * page;
+        map_bytes_ = window_end_ * sizeof(InputRecord) - map_offset_;
+        void* mapped = mmap(nullptr, map_bytes_, PROT_READ, MAP_PRIVATE, fd_, map_offset_);
+        if (mapped == MAP_FAILED) {
+            perror("mmap input window");
+            failed_ = true;
+            return false;
+        }
+        base_ = released_ = static_cast<char*>(mapped);
+        madvise(base_, map_bytes_, MADV_SEQUENTIAL);
+        ++windows_;
+        return true;
+    }
+    
+    void unmap() {
+        if (base_) munmap(base_, map_bytes_);
+        base_ = released_ = nullptr;
+    }
+    
+    const InputRecord* record(size_t index) const {
+        return reinterpret_cast<const InputRecord*>(base_ + index * sizeof(InputRecord) - map_offset_);
+    }
+    
+    // Drops the pages wholly before the slice being handed out
+    void release_behind(const char* slice) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        char* boundary = base_ + (slice - base_) / page * page;
+        if (boundary > released_) {
+            madvise(released_, boundary - released_, MADV_DONTNEED);
+            released_ = boundary;
+        }
+    }
+    
+    // Starts reading the count records from index while the current slice is processed
+    void prefetch(size_t index, size_t count) {
+        if (index >= num_records_) return;
+        if (index < window_end_) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            const char* begin = reinterpret_cast<const char*>(record(index));
+            char* aligned = base_ + (begin - base_) / page * page;
+            size_t end = std::min(index + count, window_end_);
+            madvise(aligned, reinterpret_cast<const char*>(record(end)) - aligned, MADV_WILLNEED);
+        } else {
+            size_t end = std::min(index + count, num_records_);
+            posix_fadvise(fd_, index * sizeof(InputRecord), (end - index) * sizeof(InputRecord),
+                          POSIX_FADV_WILLNEED);
+        }
+    }
+    
+    int fd_;
+    size_t num_records_;
+    size_t window_records_;
+    size_t next_ = 0;           // First record not yet handed out
+    size_t window_end_ = 0;     // One past the last record of the mapped window
+    size_t map_offset_ = 0;     // File offset of base_
+    size_t map_bytes_ = 0;
+    char* base_ = nullptr;
+    char* released_ = nullptr;  // Pages before this are already dropped
+    size_t windows_ = 0;
+    uint64_t stall_ns_ = 0;
+    bool failed_ = false;
+};
+
+// Minimal io_uring over the raw syscalls (liburing isn't part of the toolchain): one
+// submission and one completion ring, read ops only, single-threaded use
+class IoUring {
+public:
+    explicit IoUring(unsigned entries) {
+        io_uring_params params{};
+        fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ < 0) return;
+        sq_bytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_bytes_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) sq_bytes_ = cq_bytes_ = std::max(sq_bytes_, cq_bytes_);
+        sqe_bytes_ = params.sq_entries * sizeof(io_uring_sqe);
+        
+        sq_ring_ = static_cast<char*>(mmap(nullptr, sq_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                           fd_, IORING_OFF_SQ_RING));
+        cq_ring_ = (params.features & IORING_FEAT_SINGLE_MMAP)
+            ? sq_ring_
+            : static_cast<char*>(mmap(nullptr, cq_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      fd_, IORING_OFF_CQ_RING));
+        void* sqes = mmap(nullptr, sqe_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd_, IORING_OFF_SQES);
+        if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes == MAP_FAILED) {
+            close(fd_);
+            fd_ = -1;
+            return;
+        }
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.array);
+        cq_head_ = reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq_ring_ + params.cq_off.cqes);
+    }
+    
+    ~IoUring() {
+        if (fd_ < 0) return;
+        munmap(sqes_, sqe_bytes_);
+        if (cq_ring_ != sq_ring_) munmap(cq_ring_, cq_bytes_);
+        munmap(sq_ring_, sq_bytes_);
+        close(fd_);
+    }
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+    
+    bool ok() const { return fd_ >= 0; }
+    
+    // Queues and submits one read; tag comes back in the completion's user_data
+    bool read(int fd, void* buf, unsigned len, uint64_t offset, uint64_t tag) {
+        unsigned tail = *sq_tail_;
+        unsigned index = tail & sq_mask_;
+        io_uring_sqe& sqe = sqes_[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(buf);
+        sqe.len = len;
+        sqe.off = offset;
+        sqe.user_data = tag;
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        return syscall(__NR_io_uring_enter, fd_, 1, 0, 0, nullptr, 0) == 1;
+    }
+    
+    // Oldest completion into cqe; false if there is none (wait: block until one arrives)
+    bool pop(io_uring_cqe& cqe, bool wait) {
+        unsigned head = *cq_head_;
+        while (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            if (!wait) return false;
+            if (syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+                return false;
+            }
+        }
+        cqe = cqes_[head & cq_mask_];
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    int fd_ = -1;
+    char* sq_ring_ = nullptr;
+    char* cq_ring_ = nullptr;
+    size_t sq_bytes_ = 0, cq_bytes_ = 0, sqe_bytes_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned* sq_array_ = nullptr;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+};
+
+// Read-ahead input for archived replays on shared storage (--uring DEPTH): keeps DEPTH
+// large O_DIRECT reads in flight into hugepage buffers and hands each completed buffer to
+// the replay loop in file order, resubmitting it for the chunk DEPTH ahead once the loop
+// asks for the next one. Completions are reaped from the io_uring completion ring on the
+// book builder's thread without a syscall; it only blocks when the next chunk hasn't
+// landed yet, and that wait is stall_ns(). A record split across two chunks is completed
+// by copying its head into the page reserved before the next buffer, so every span is
+// whole records. O_DIRECT falls back to buffered reads where the filesystem refuses it.
+class UringInput {
+public:
+    UringInput(const char* path, size_t depth, size_t buffer_bytes)
+        : depth_(std::max<size_t>(depth, 2)),  // The carried record head lands in the next buffer
+          buffer_bytes_(std::max(kPrefix, buffer_bytes / kPrefix * kPrefix)),
+          ring_(static_cast<unsigned>(depth_)) {
+        fd_ = open(path, O_RDONLY | O_DIRECT);
+        if (fd_ < 0 && errno == EINVAL) {
+            direct_ = false;
+            fd_ = open(path, O_RDONLY);
+        }
+        struct stat sb;
+        if (fd_ < 0 || fstat(fd_, &sb) != 0) { fail("open input"); return; }
+        if (!ring_.ok()) { fail("io_uring_setup"); return; }
+        file_bytes_ = sb.st_size;
+        num_chunks_ = (file_bytes_ + buffer_bytes_ - 1) / buffer_bytes_;
+        
+        size_t stride = kPrefix + buffer_bytes_;
+        region_bytes_ = (depth_ * stride + kHugePage - 1) & ~(kHugePage - 1);
+        region_ = static_cast<char*>(map_huge_pages(region_bytes_, huge_tlb_));
+        if (!region_) { fail("mmap read buffers"); return; }
+        for (size_t i = 0; i < depth_; ++i) {
+            buffers_.push_back(region_ + i * stride + kPrefix);
+            results_.push_back(kPending);
+            filled_.push_back(0);
+        }
+        for (size_t chunk = 0; chunk < std::min(depth_, num_chunks_); ++chunk) submit(chunk);
+    }
+    
+    ~UringInput() {
+        io_uring_cqe cqe;
+        while (in_flight_ && ring_.pop(cqe, true)) --in_flight_;  // The kernel still owns those buffers
+        if (region_) munmap(region_, region_bytes_);
+        if (fd_ >= 0) close(fd_);
+    }
+    UringInput(const UringInput&) = delete;
+    UringInput& operator=(const UringInput&) = delete;
+    
+    // Records of the next chunk; empty at end of file or on a read error
+    std::span<const InputRecord> next() {
+        if (failed_) return {};
+        if (in_use_ != kNone) {
+            if (in_use_ + depth_ < num_chunks_) submit(in_use_ + depth_);
+            in_use_ = kNone;
+        }
+        if (next_chunk_ == num_chunks_) return {};
+        
+        size_t index = next_chunk_ % depth_;
+        size_t expected = std::min(buffer_bytes_, file_bytes_ - next_chunk_ * buffer_bytes_);
+        reap(false);
+        while (true) {
+            if (results_[index] == kPending) {
+                uint64_t start = PerfProfileNs();
+                while (results_[index] == kPending && !failed_) reap(true);
+                stall_ns_ += PerfProfileNs() - start;
+            }
+            int64_t result = results_[index];
+            if (failed_ || result <= 0) {
+                if (!failed_) cerr << "io_uring read of chunk " << next_chunk_ << ": "
+                                   << (result < 0 ? strerror(static_cast<int>(-result)) : "unexpected end of file") << endl;
+                failed_ = true;
+                return {};
+            }
+            size_t filled = filled_[index] + result;
+            if (filled >= expected) break;
+            // Reads may legally stop short (a signal, a device limit): fetch the rest of the
+            // range, restarting O_DIRECT at the last aligned offset it reached
+            PerfProfileCount("uring_short_reads", 1);
+            submit(next_chunk_, direct_ ? filled / kPrefix * kPrefix : filled);
+        }
+        
+        char* data = buffers_[index] - carry_;
+        size_t bytes = carry_ + expected;
+        size_t whole = bytes / sizeof(InputRecord) * sizeof(InputRecord);
+        carry_ = bytes - whole;
+        memcpy(buffers_[(index + 1) % depth_] - carry_, data + whole, carry_);
+        in_use_ = next_chunk_++;
+        return {reinterpret_cast<const InputRecord*>(data), whole / sizeof(InputRecord)};
+    }
+    
+    bool failed() const { return failed_; }
+    uint64_t stall_ns() const { return stall_ns_; }
+    bool direct() const { return direct_; }
+    bool huge_tlb() const { return huge_tlb_; }
+    size_t depth() const { return depth_; }
+    size_t buffer_bytes() const { return buffer_bytes_; }
+
+private:
+    static constexpr size_t kPrefix = 4096;  // O_DIRECT alignment; holds the carried record head
+    static constexpr size_t kHugePage = size_t(2) << 20;
+    static constexpr size_t kNone = ~size_t(0);
+    static constexpr int64_t kPending = INT64_MIN;
+    
+    // Reads chunk's bytes from offset from (nonzero when completing a short read)
+    void submit(size_t chunk, size_t from = 0) {
+        size_t index = chunk % depth_;
+        results_[index] = kPending;
+        filled_[index] = from;
+        if (!ring_.read(fd_, buffers_[index] + from, static_cast<unsigned>(buffer_bytes_ - from),
+                        chunk * buffer_bytes_ + from, index)) {
+            fail("io_uring_enter");
+            return;
+        }
+        ++in_flight_;
+    }
+    
+    void reap(bool wait) {
+        io_uring_cqe cqe;
+        if (!ring_.pop(cqe, wait)) {
+            if (wait) fail("io_uring_enter");
+            return;
+        }
+        do {
+            results_[cqe.user_data] = cqe.res;
+            --in_flight_;
+        } while (ring_.pop(cqe, false));
+    }
+    
+    void fail(const char* what) {
+        perror(what);
+        failed_ = true;
+    }
+    
+    size_t depth_;
+    size_t buffer_bytes_;
+    IoUring ring_;
+    int fd_ = -1;
+    bool direct_ = true;
+    bool huge_tlb_ = false;
+    size_t file_bytes_ = 0;
+    size_t num_chunks_ = 0;
+    char* region_ = nullptr;
+    size_t region_bytes_ = 0;
+    std::vector<char*> buffers_;    // Read targets, each preceded by kPrefix spare bytes
+    std::vector<int64_t> results_;  // Completed read size (or -errno) per buffer, kPending in flight
+    std::vector<size_t> filled_;    // Bytes already in each buffer before its read in flight
+    size_t in_flight_ = 0;
+    size_t next_chunk_ = 0;         // Next chunk to hand out
+    size_t in_use_ = kNone;         // Chunk currently handed out, resubmitted on the next call
+    size_t carry_ = 0;              // Bytes of a split record copied before the next buffer
+    uint64_t stall_ns_ = 0;
+    bool failed_ = false;
+};
+
 // --- Main ---
+
+// Contract list for the pre-session warm-up: one "token [expected_orders [expected_levels]]"
+// per line, '#' starts a comment. False if the file can't be opened.
+static bool load_contracts(const char* path, std::vector<ContractSpec>& contracts) {
+    FILE* f = fopen(path, "r");
+    if (!f) return false;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (char* comment = strchr(line, '#')) *comment = 0;
+        ContractSpec contract{};
+        if (sscanf(line, "%u %u %u", &contract.token, &contract.expected_orders, &contract.expected_levels) >= 1) {
+            contracts.push_back(contract);
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+// Publisher throughput of interleaved execution vs in-flight width over the whole replay
+// (deltas are discarded as published); meaningful on many-instrument feeds, where
+// consecutive records rarely share a token
+static void run_interleave_bench(const InputRecord* records, size_t num_records) {
+    constexpr size_t kWindow = 1024;
+    auto discard = [](const DeltaChunk&) {};
+    // The first pass only warms the allocator and page tables, and isn't reported
+    bool warm = false;
+    for (size_t width : {0, 0, 1, 2, 4, 8, 16, 32}) {
+        Runner runner;
+        uint64_t start = PerfProfileNs();
+        for (size_t begin = 0; begin < num_records; begin += kWindow) {
+            size_t count = std::min(kWindow, num_records - begin);
+            if (width == 0) {
+                for (size_t i = begin; i < begin + count; ++i) runner.process_record(records[i]);
+            } else {
+                runner.process_interleaved(std::span<const InputRecord>(records + begin, count), width);
+            }
+            runner.take_published(discard);
+        }
+        uint64_t ns = std::max<uint64_t>(PerfProfileNs() - start, 1);
+        if (!std::exchange(warm, true)) continue;
+        cout << "interleave width " << width << (width ? "" : " (sequential)") << ": "
+             << num_records * 1e3 / ns << " Mrec/s, " << double(ns) / num_records << " ns/record" << endl;
+    }
+}
 int main(int argc, char** argv) {
     if (argc < 2) {
-        cerr << "Usage: " << argv[0] << " <input.bin> [<reference.bin>] [--crossing] [--dump]" << endl;
+        cerr << "Usage: " << argv[0] << " <input.bin> [<reference.bin>] [--crossing] [--dump]"
+             << " [--snapshot-every N] [--tick-size T] [--chunk-stats] [--pack]"
+             << " [--consume-every K] [--conflate CHUNKS] [--columnar-bench] [--analytics-check] [--top-only]"
+             << " [--history EVENTS [--history-check]] [--shards N [--rebalance]] [--pipeline] [--batch-window N]\n"
+             << "       [--interleave K] [--interleave-bench] [--cold-after SECONDS] [--hugepages]\n"
+             << "       [--contracts FILE [--warmup-rounds N]]" << endl
+             << "       [--cpu-main CPU] [--cpu-publisher CPU] [--cpu-dispatcher CPU] [--cpu-workers LIST]" << endl
+             << "       [--fifo PRIORITY] [--mlock] [--preflight]" << endl
+             << "       [--stream-window MB | --uring DEPTH [--uring-buffer MB]]" << endl;
         return 1;
     }
 
     const char* input_file = argv[1];
     const char* reference_file = nullptr;
     bool dump_mode = false;
+    size_t snapshot_every = 0;  // Re-bootstrap the receiver from a snapshot every N records
+    Price tick_size = 0;        // Enables tick-offset snapshot rows
+    size_t consume_every = 1;   // Lagging-strategy simulation: drain deltas every K records
+    size_t num_shards = 0;      // Token-sharded worker threads (0 = single-threaded Runner)
+    bool rebalance = false;     // Sharded mode: migrate hot tokens between workers
+    bool pipelined = false;     // Publisher and strategy on separate threads
+    size_t batch_window = 0;    // Group records by token within windows of N (0 = off)
+    size_t interleave_width = 0;  // Records in flight as coroutines (0 = off)
+    bool interleave_bench = false;
+    const char* contracts_file = nullptr;  // Pre-session warm-up contract list
+    size_t warmup_rounds = 0;   // Synthetic traffic rounds per contract during warm-up
+    bool lock_memory = false;   // mlockall before the replay
+    bool preflight = false;     // Host checks even without a placement
+    size_t stream_window = 0;   // Bytes of input mapped at a time (0 = map the whole file)
+    size_t uring_depth = 0;     // io_uring reads in flight (0 = mmap input)
+    size_t uring_buffer = size_t(4) << 20;  // Bytes per io_uring read
 
     // Second positional arg (non-flag) is reference file
     for (int i = 2; i < argc; ++i) {
@@ -1765,27 +5157,130 @@ int main(int argc, char** argv) {
             g_crossing_enabled = true;
         } else if (string(argv[i]) == "--dump") {
             dump_mode = true;
+        } else if (string(argv[i]) == "--chunk-stats") {
+            g_chunk_stats = true;
+        } else if (string(argv[i]) == "--pack") {
+            g_pack_chunks = true;
+        } else if (string(argv[i]) == "--history-check") {
+            g_history_check = true;
+        } else if (string(argv[i]) == "--analytics-check") {
+            g_analytics_check = true;
+        } else if (string(argv[i]) == "--columnar-bench") {
+            g_columnar_bench = true;
+        } else if (string(argv[i]) == "--top-only") {
+            g_top_only = true;
+        } else if (string(argv[i]) == "--history" && i + 1 < argc) {
+            g_history_events = strtoul(argv[++i], nullptr, 10);
+        } else if (string(argv[i]) == "--contracts" && i + 1 < argc) {
+            contracts_file = argv[++i];
+        } else if (string(argv[i]) == "--warmup-rounds" && i + 1 < argc) {
+            warmup_rounds = strtoul(argv[++i], nullptr, 10);
+        } else if (string(argv[i]) == "--cpu-main" && i + 1 < argc) {
+            g_placement.main = atoi(argv[++i]);
+        } else if (string(argv[i]) == "--cpu-publisher" && i + 1 < argc) {
+            g_placement.publisher = atoi(argv[++i]);
+        } else if (string(argv[i]) == "--cpu-dispatcher" && i + 1 < argc) {
+            g_placement.dispatcher = atoi(argv[++i]);
+        } else if (string(argv[i]) == "--cpu-workers" && i + 1 < argc) {
+            g_placement.workers = parse_cpu_list(argv[++i]);
+        } else if (string(argv[i]) == "--fifo" && i + 1 < argc) {
+            g_placement.fifo_priority = atoi(argv[++i]);
+        } else if (string(argv[i]) == "--mlock") {
+            lock_memory = true;
+        } else if (string(argv[i]) == "--preflight") {
+            preflight = true;
+        } else if (string(argv[i]) == "--stream-window" && i + 1 < argc) {
+            stream_window = strtoul(argv[++i], nullptr, 10) << 20;
+        } else if (string(argv[i]) == "--uring" && i + 1 < argc) {
+            uring_depth = strtoul(argv[++i], nullptr, 10);
+        } else if (string(argv[i]) == "--uring-buffer" && i + 1 < argc) {
+            uring_buffer = strtoul(argv[++i], nullptr, 10) << 20;
+        } else if (string(argv[i]) == "--hugepages") {
+            g_instrument_arena = &HugePageArena::instance();
+        } else if (string(argv[i]) == "--cold-after" && i + 1 < argc) {
+            g_cold_after_ns = static_cast<uint64_t>(strtod(argv[++i], nullptr) * 1e9);
+        } else if (string(argv[i]) == "--shards" && i + 1 < argc) {
+            num_shards = strtoul(argv[++i], nullptr, 10);
+        } else if (string(argv[i]) == "--rebalance") {
+            rebalance = true;
+        } else if (string(argv[i]) == "--pipeline") {
+            pipelined = true;
+        } else if (string(argv[i]) == "--batch-window" && i + 1 < argc) {
+            batch_window = strtoul(argv[++i], nullptr, 10);
+        } else if (string(argv[i]) == "--interleave" && i + 1 < argc) {
+            interleave_width = strtoul(argv[++i], nullptr, 10);
+        } else if (string(argv[i]) == "--interleave-bench") {
+            interleave_bench = true;
+        } else if (string(argv[i]) == "--snapshot-every" && i + 1 < argc) {
+            snapshot_every = strtoul(argv[++i], nullptr, 10);
+        } else if (string(argv[i]) == "--tick-size" && i + 1 < argc) {
+            tick_size = strtol(argv[++i], nullptr, 10);
+        } else if (string(argv[i]) == "--consume-every" && i + 1 < argc) {
+            consume_every = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        } else if (string(argv[i]) == "--conflate" && i + 1 < argc) {
+            g_conflate_threshold = strtoul(argv[++i], nullptr, 10);
         } else if (argv[i][0] != '-') {
             reference_file = argv[i];
         }
     }
     
+    if (g_history_check && !g_history_events) {
+        cerr << "--history-check needs --history EVENTS" << endl;
+        return 1;
+    }
+    
+    if (g_pack_chunks && !Runner::kPackingUseful) {
+        cerr << "Warning: --pack has no effect with " << sizeof(DeltaChunk)
+             << "-byte chunks (build with CHUNK_BYTES=128)" << endl;
+    }
+    
     // Auto-detect crossing mode from filename if not explicitly set
     if (!g_crossing_enabled && string(input_file).find("_crossing") != string::npos &&
         string(input_file).find("_nocrossing") == string::npos) {
         g_crossing_enabled = true;
     }
 
-    // mmap input records
+    // Only the normal loop consumes input slice by slice; the other modes index the whole file
+    bool sliced_input = stream_window || uring_depth;
+    if (sliced_input && (dump_mode || num_shards || pipelined || interleave_bench || interleave_width || batch_window)) {
+        cerr << "--stream-window and --uring only apply to the normal replay mode" << endl;
+        return 1;
+    }
+    if (stream_window && uring_depth) {
+        cerr << "--stream-window and --uring are alternative readers" << endl;
+        return 1;
+    }
+    
+    std::vector<PlannedThread> threads = g_placement.plan(dump_mode ? 0 : num_shards, !dump_mode && !num_shards && pipelined);
+    if (g_placement.fifo_priority > 0 && ThreadPlacement::fifo_cpu_shared(threads)) {
+        cerr << "Warning: --fifo ignored: a placed thread shares its CPU and would starve its neighbour" << endl;
+        g_placement.fifo_priority = 0;
+    }
+    // Placed before any Runner exists so the main thread's books are first touched on its node
+    g_placement.save_initial_affinity();
+    place_current_thread(g_placement.main, -1, "main");
+    bool memory_locked = lock_memory && lock_process_memory();
+    if (preflight || lock_memory || g_placement.configured() || g_placement.fifo_priority > 0) {
+        report_preflight(threads, g_instrument_arena != nullptr, lock_memory, memory_locked);
+    }
+
+    std::vector<ContractSpec> contracts;
+    if (contracts_file && !load_contracts(contracts_file, contracts)) { perror("open contracts"); return 1; }
+
+    // mmap input records (streamed and io_uring input are read slice by slice in the replay loop)
     int fd = open(input_file, O_RDONLY);
     if (fd < 0) { perror("open input"); return 1; }
     struct stat sb;
     fstat(fd, &sb);
-    void* mapped = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mapped == MAP_FAILED) { perror("mmap input"); close(fd); return 1; }
-    madvise(mapped, sb.st_size, MADV_WILLNEED);
-    const InputRecord* records = static_cast<const InputRecord*>(mapped);
+    void* mapped = nullptr;
+    const InputRecord* records = nullptr;
     size_t num_records = sb.st_size / sizeof(InputRecord);
+    if (!sliced_input) {
+        mapped = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) { perror("mmap input"); close(fd); return 1; }
+        madvise(mapped, sb.st_size, MADV_WILLNEED);
+        records = static_cast<const InputRecord*>(mapped);
+    }
 
     // mmap reference (optional)
     const OutputRecord* ref_books = nullptr;
@@ -1805,7 +5300,23 @@ int main(int argc, char** argv) {
         }
     }
 
+    // Data-TLB read misses across the whole run, worker threads included
+    HwCounter dtlb_misses(PERF_TYPE_HW_CACHE,
+                          PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), /*inherit=*/true);
+    
+    // Pre-session: the main Runner warms up here, shard workers on their own threads
+    // (pipelined mode builds its Runners at start and isn't pre-warmed)
     Runner runner;
+    if (!contracts.empty() && num_shards == 0) {
+        uint64_t start = PerfProfileNs();
+        runner.warm_up(contracts, warmup_rounds);
+        cout << "Warm-up: " << contracts.size() << " contracts, " << warmup_rounds << " traffic rounds, "
+             << (PerfProfileNs() - start) / 1'000'000 << " ms" << endl;
+        // Report and reset the warm-up traffic's profile so live figures stand alone
+        if (warmup_rounds) PerfProfilerReport();
+    }
+    uint64_t dtlb_start = dtlb_misses.read();
     int exit_code = 0;
     
     if (dump_mode) {
@@ -1821,6 +5332,8 @@ int main(int argc, char** argv) {
             runner.process_record(rec);
             runner.process_deltas(dump_observer);
         }
+        runner.flush_deltas();
+        runner.process_deltas(dump_observer);
         
         if (reference_file && ref_books) {
             FILE* f_ref = fopen("dump_reference.txt", "w");
@@ -1839,24 +5352,151 @@ int main(int argc, char** argv) {
         fclose(f_ours);
         printf("Dumped to dump_input.txt, dump_ours.txt%s\n",
                reference_file ? ", dump_reference.txt" : "");
+    } else if (num_shards > 0) {
+        // Sharded mode: deltas are drained after every record inside each worker, so
+        // --consume-every, --snapshot-every and packing don't apply. With a reference the
+        // outputs are merged back into input order and validated here.
+        ReferenceValidator validator(ref_books, num_ref_books, records);
+        validator.set_sparse_delivery(g_top_only);
+        ShardedRunner sharded(num_shards, reference_file != nullptr, rebalance);
+        sharded.set_warm_up(contracts, warmup_rounds);
+        if (!sharded.run(records, num_records, validator)) exit_code = 1;
+    } else if (pipelined) {
+        // Pipelined mode: the strategy drains as fast as it can, so --consume-every and
+        // --snapshot-every don't apply
+        ReferenceValidator validator(ref_books, num_ref_books, records);
+        validator.set_sparse_delivery(g_top_only);
+        PipelinedRunner pipeline;
+        if (!pipeline.run(records, num_records, validator)) exit_code = 1;
+    } else if (interleave_bench) {
+        run_interleave_bench(records, num_records);
+    } else if (interleave_width > 0) {
+        // Interleaved mode: the delta stream is identical to sequential processing, so the
+        // validator drains it once per window of records
+        ReferenceValidator validator(ref_books, num_ref_books, records);
+        validator.set_sparse_delivery(g_top_only);
+        constexpr size_t kWindow = 1024;
+        for (size_t begin = 0; begin < num_records; begin += kWindow) {
+            size_t count = std::min(kWindow, num_records - begin);
+            runner.process_interleaved(std::span<const InputRecord>(records + begin, count), interleave_width);
+            validator.set_current_input(begin + count - 1);
+            if (!runner.process_deltas(validator)) {
+                exit_code = 1;
+                break;
+            }
+        }
+        runner.flush_deltas();
+        if (exit_code == 0 && !runner.process_deltas(validator)) exit_code = 1;
+    } else if (batch_window > 0) {
+        // Batched mode: records are grouped by token per window. Validation drains each
+        // record's deltas as it is processed (so packing doesn't apply) and restores input
+        // order before comparing; without a reference, deltas drain once per window.
+        ReferenceValidator validator(ref_books, num_ref_books, records);
+        validator.set_sparse_delivery(g_top_only);
+        OrderRestorer<ReferenceValidator> restorer(validator);
+        for (size_t begin = 0; begin < num_records && exit_code == 0; begin += batch_window) {
+            std::span<const InputRecord> batch(records + begin, std::min(batch_window, num_records - begin));
+            if (!reference_file) {
+                runner.process_batch(batch);
+                runner.process_deltas(validator);
+                continue;
+            }
+            runner.process_batch(batch, [&](size_t i) {
+                restorer.set_position(static_cast<uint32_t>(i));
+                runner.flush_deltas();
+                runner.process_deltas(restorer);
+            });
+            if (!restorer.release(begin)) exit_code = 1;
+        }
+        runner.flush_deltas();
+        if (exit_code == 0 && !runner.process_deltas(validator)) exit_code = 1;
     } else {
         // Normal mode: process records, compare against reference via observer
         ReferenceValidator validator(ref_books, num_ref_books, records);
+        validator.set_sparse_delivery(g_top_only);
         
-        for (size_t input_idx = 0; input_idx < num_records; ++input_idx) {
-            runner.process_record(records[input_idx]);
+        auto replay = [&](const InputRecord& rec, size_t input_idx) {
+            runner.process_record(rec);
             validator.set_current_input(input_idx);
-            if (!runner.process_deltas(validator)) {
-                exit_code = 1;
-                break;
+            if ((input_idx + 1) % consume_every == 0 && !runner.process_deltas(validator)) return false;
+            // Late-joiner simulation: receiver book is overwritten from the snapshot and
+            // must keep matching the reference afterwards
+            if (snapshot_every && (input_idx + 1) % snapshot_every == 0 &&
+                runner.emit_snapshot(rec.token, tick_size)) {
+                runner.process_deltas(validator);
+            }
+            return true;
+        };
+        
+        auto replay_slices = [&](auto& source) {
+            size_t input_idx = 0;
+            for (auto slice = source.next(); !slice.empty() && exit_code == 0; slice = source.next()) {
+                for (const InputRecord& rec : slice) {
+                    if (!replay(rec, input_idx++)) {
+                        exit_code = 1;
+                        break;
+                    }
+                }
+            }
+            if (source.failed()) exit_code = 1;
+        };
+        
+        if (stream_window) {
+            StreamingInput stream(fd, sb.st_size, stream_window);
+            replay_slices(stream);
+            cout << "Input: streamed through a " << (stream.window_bytes() >> 20) << " MB window ("
+                 << stream.windows() << " windows), stall " << stream.stall_ns() / 1'000'000 << " ms" << endl;
+        } else if (uring_depth) {
+            UringInput uring(input_file, uring_depth, uring_buffer);
+            replay_slices(uring);
+            cout << "Input: io_uring, " << uring.depth() << " x " << (uring.buffer_bytes() >> 10) << " KB "
+                 << (uring.direct() ? "O_DIRECT" : "buffered") << " reads into "
+                 << (uring.huge_tlb() ? "MAP_HUGETLB" : "THP") << " buffers, stall "
+                 << uring.stall_ns() / 1'000'000 << " ms" << endl;
+        } else {
+            // The whole file is mapped, but each slice is faulted in before it is replayed so
+            // the page-cache waits are measured the way the streamed reader measures them
+            constexpr size_t kFaultSlice = (size_t(4) << 20) / sizeof(InputRecord);
+            uint64_t stall_ns = 0;
+            for (size_t begin = 0; begin < num_records && exit_code == 0; begin += kFaultSlice) {
+                size_t end = std::min(begin + kFaultSlice, num_records);
+                stall_ns += fault_in_pages(records + begin, records + end);
+                for (size_t input_idx = begin; input_idx < end; ++input_idx) {
+                    if (!replay(records[input_idx], input_idx)) {
+                        exit_code = 1;
+                        break;
+                    }
+                }
             }
+            cout << "Input: mapped whole, " << (num_records * sizeof(InputRecord) >> 20)
+                 << " MB faulted in per 4 MB slice, stall " << stall_ns / 1'000'000 << " ms" << endl;
         }
+        runner.flush_deltas();
+        if (exit_code == 0 && !runner.process_deltas(validator)) exit_code = 1;
     }
 
     runner.report_active_orders();
     PerfProfilerReport();
+    if (dtlb_misses.available()) {
+        uint64_t misses = dtlb_misses.read() - dtlb_start;
+        cout << "dTLB read misses: " << misses << " (" << double(misses) / std::max<size_t>(num_records, 1)
+             << "/record), instrument state on ";
+        if (!g_instrument_arena) {
+            cout << "heap" << endl;
+        } else {
+            size_t huge_tlb = g_instrument_arena->huge_tlb_bytes(), thp = g_instrument_arena->thp_bytes();
+            cout << (!thp ? "MAP_HUGETLB" : !huge_tlb ? "THP" : "mixed") << " arena (" << (huge_tlb >> 20)
+                 << " MB MAP_HUGETLB, " << (thp >> 20) << " MB THP)" << endl;
+        }
+    }
+
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    cout << "Peak RSS: " << usage.ru_maxrss / 1024 << " MB (" << (sb.st_size >> 20) << " MB input "
+         << (stream_window ? "streamed" : uring_depth ? "read via io_uring" : "mapped whole") << "), "
+         << usage.ru_majflt << " major faults" << endl;
 
-    munmap(mapped, sb.st_size);
+    if (mapped) munmap(mapped, sb.st_size);
     if (ref_mapped && ref_mapped != MAP_FAILED) munmap(ref_mapped, num_ref_books * sizeof(OutputRecord));
     close(fd);
     return exit_code;
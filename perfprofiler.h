@@ -92,7 +92,25 @@ class PerfProfiler {
         return (tsc * m_tsc2ns) / 65536;
     }
 
+    // stat_t::accum is not atomic, so threads that share stat names must not run concurrently.
+    // A thread that runs alongside others tags itself first: its stats become "name.tag|fmt",
+    // with the name truncated so the tag always fits.
+    static void set_thread_tag(const char* tag) {
+        strncpy(t_tag, tag, sizeof(t_tag) - 1);
+        t_tag[sizeof(t_tag) - 1] = 0;
+    }
+
     stat_t* get(const char* name) {
+        char tagged[stat_t::NAMELEN];
+        if (t_tag[0]) {
+            const char* format = strchr(name, '|');
+            size_t base = format ? size_t(format - name) : strlen(name);
+            size_t suffix = 1 + strlen(t_tag) + (format ? strlen(format) : 0);
+            if (suffix >= stat_t::NAMELEN) return &m_drain;
+            base = std::min(base, stat_t::NAMELEN - 1 - suffix);
+            snprintf(tagged, sizeof(tagged), "%.*s.%s%s", int(base), name, t_tag, format ? format : "");
+            name = tagged;
+        }
         if (strnlen(name, stat_t::NAMELEN) >= stat_t::NAMELEN) return &m_drain;
         if (nullptr == m_page) return &m_drain;
 
@@ -123,8 +141,7 @@ class PerfProfiler {
         }
 
         stat_t* stat = &m_page->stats[m_page->count];
-        strncpy(stat->name, name, stat_t::NAMELEN - 1);
-        stat->name[stat_t::NAMELEN - 1] = 0;
+        memcpy(stat->name, name, strnlen(name, stat_t::NAMELEN - 1));  // Tail is zero from init
         stat->reset();
         m_page->count++;
         
@@ -177,6 +194,7 @@ class PerfProfiler {
     PerfProfiler(std::string name, uint64_t report_ms = 0, std::string path = "");
     ~PerfProfiler();
     static inline PerfProfiler* s_singleton = nullptr;
+    static inline thread_local char t_tag[8] = {};
     
   private:
     std::string m_name;